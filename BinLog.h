@@ -0,0 +1,230 @@
+#pragma once
+#include <bmu/Logger.h>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace beam_me_up {
+
+/// Deferred (binary) logging. Call site keeps only id of its static format descriptor and raw
+/// bytes of arguments, formatting is done by backend thread or offline by \ref decodeBinlog.
+/// Format string is UTF-8 with {} placeholders, {{ and }} are literal braces.
+///
+/// Record (same in queue and in binary file after 'R' entry kind), native byte order:
+///   u32 format id, u64 nanoseconds since epoch, u32 length of arguments, arguments
+/// Argument is u8 type tag followed by value, strings are u32 length and UTF-8 octets.
+/// Binary file starts with "BMUBLOG2" and has these kinds of entries:
+///   'F' u32 id, u8 level, u32 line, u32 length, file, u32 length, format (before first use of id)
+///   'K' u32 id, u32 count, count times u32 length and key (after 'F' of structured record)
+///   'R' record
+/// Files which start with "BMUBLOG1" have u16 instead of u32 counts and lengths in 'F' and 'K'.
+///
+/// Structured record (\see LVLSLOG) has the message as format, its arguments are thread id, thread
+/// name and then values of fields in order of keys.
+enum binarg_e {
+	BINARG_INT = 1, ///< i64
+	BINARG_UINT, ///< u64
+	BINARG_DOUBLE, ///< f64
+	BINARG_CHAR, ///< u32 codepoint
+	BINARG_STR, ///< u32 length and UTF-8 octets
+	BINARG_PTR, ///< u64 address
+	BINARG_BOOL, ///< u8
+};
+
+/// Static description of one binary logging call site
+struct BinlogFormat {
+	std::uint32_t id;
+	loglevel_e    level;
+	unsigned int  line;
+	std::string   file;
+	std::string   format;
+	std::vector<std::string> keys; ///< names of fields of structured record, empty for format string
+};
+
+/// Registers call site and gives its id. Called once per call site from \ref LVLBLOG with file name
+/// already stripped of path (\see SOURCE_SITE), records refer to the site only by the id.
+std::uint32_t registerBinlogFormat(loglevel_e lvl, char const* format, char const* file, unsigned int line);
+/// Registers structured call site, \see LVLSLOG
+std::uint32_t registerStructuredFormat(loglevel_e lvl, char const* message, char const* file, unsigned int line, char const* const* keys, size_t nkeys);
+/// Registered call site or nullptr. Pointer stays valid until end of program.
+BinlogFormat const* findBinlogFormat(std::uint32_t id);
+
+/// Appends UTF-8 text of one record (timestamp, level and formatted message) to out, structured
+/// record is written in given style. False for malformed record.
+bool formatBinlogRecord(BinlogFormat const& fmt, char const* rec, size_t n, std::string& out, structformat_e style = STRUCTFORMAT_LOGFMT);
+/// Reads binary log file written after \ref LogsFactoryBase::setBinlogOutput and writes it as UTF-8 text.
+/// Returns number of decoded records or -1 if input isn't binary log. Truncated or corrupted entry stops
+/// decoding and sets badbit of in, records before it are written.
+long long decodeBinlog(std::istream& in, std::ostream& out, structformat_e style = STRUCTFORMAT_LOGFMT);
+
+/// Per-thread encoder of one record, buffer is reused for every record of the thread.
+class BinlogEncoder {
+	BinlogEncoder(BinlogEncoder const&) = delete;
+	void operator = (BinlogEncoder const&) = delete;
+	BinlogEncoder(void)
+		: level(LINFO)
+	{ }
+public:
+	static BinlogEncoder& forThread(void);
+	/// Level is used by writer's overflow policy \see QueuePolicy
+	void begin(std::uint32_t id, loglevel_e lvl);
+	/// Completes record and puts it in the queue of logger backend
+	void submit(void);
+	template<typename _T>
+	typename std::enable_if<std::is_integral<_T>::value && std::is_signed<_T>::value>::type put(_T v)
+	{
+		putTagged(BINARG_INT, (std::int64_t)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_integral<_T>::value && !std::is_signed<_T>::value>::type put(_T v)
+	{
+		putTagged(BINARG_UINT, (std::uint64_t)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_floating_point<_T>::value>::type put(_T v)
+	{
+		putTagged(BINARG_DOUBLE, (double)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_enum<_T>::value>::type put(_T v)
+	{
+		putTagged(BINARG_INT, (std::int64_t)v);
+	}
+	void put(char v)
+	{
+		putTagged(BINARG_CHAR, (std::uint32_t)(unsigned char)v);
+	}
+	void put(wchar_t v)
+	{
+		putTagged(BINARG_CHAR, (std::uint32_t)v);
+	}
+	void put(void const* v)
+	{
+		putTagged(BINARG_PTR, (std::uint64_t)(std::uintptr_t)v);
+	}
+	void put(bool v)
+	{
+		putTagged(BINARG_BOOL, (std::uint8_t)(v ? 1 : 0));
+	}
+	/// Thread id and name, the first arguments of structured record
+	void putThread(void);
+	void put(char const* s);
+	void put(std::string const& s)
+	{
+		putString(s.data(), s.size());
+	}
+	void put(wchar_t const* s);
+	void put(std::wstring const& s)
+	{
+		putString(s.data(), s.size());
+	}
+private:
+	template<typename _T>
+	void putTagged(binarg_e tag, _T v)
+	{
+		buf.push_back((char)tag);
+		buf.append((char const*)&v, sizeof(v));
+	}
+	void putString(char const* s, size_t n);
+	void putString(wchar_t const* s, size_t n);
+	std::string buf;
+	loglevel_e  level;
+};
+
+inline void binlog_args(BinlogEncoder& /*enc*/)
+{ }
+
+template<typename _T, typename... _Args>
+inline void binlog_args(BinlogEncoder& enc, _T const& v, _Args const&... args)
+{
+	enc.put(v);
+	binlog_args(enc, args...);
+}
+
+template<typename... _Args>
+inline void binlog(loglevel_e lvl, std::uint32_t id, _Args const&... args)
+{
+	BinlogEncoder& enc(BinlogEncoder::forThread());
+	enc.begin(id, lvl);
+	binlog_args(enc, args...);
+	enc.submit();
+}
+
+/// Typed field of structured record, value is encoded without formatting \see LVLSLOG
+template<typename _T>
+struct LogField {
+	char const* key;
+	_T const&   value;
+};
+
+template<typename _T>
+inline LogField<_T> field(char const* key, _T const& value)
+{
+	return LogField<_T>{ key, value };
+}
+
+/// Static part of structured call site, id is registered with the first record
+struct StructlogSite {
+	constexpr StructlogSite(loglevel_e level, char const* message, char const* file, unsigned int line)
+		: level(level)
+		, message(message)
+		, file(file)
+		, line(line)
+		, id(0)
+	{ }
+	loglevel_e const          level;
+	char const* const         message;
+	char const* const         file;
+	unsigned int const        line;
+	std::atomic<std::uint32_t> id; ///< registered id + 1
+};
+
+inline void structlog_fields(BinlogEncoder& /*enc*/)
+{ }
+
+template<typename _T, typename... _Fields>
+inline void structlog_fields(BinlogEncoder& enc, LogField<_T> const& f, _Fields const&... fields)
+{
+	enc.put(f.value);
+	structlog_fields(enc, fields...);
+}
+
+template<typename... _Fields>
+inline void structlog(StructlogSite& site, _Fields const&... fields)
+{
+	std::uint32_t id = site.id.load(std::memory_order_acquire);
+	if (!id) { // first record of the site
+		char const* const keys[] = { fields.key..., nullptr };
+		std::uint32_t expected = 0;
+		id = registerStructuredFormat(site.level, site.message, site.file, site.line, keys, sizeof...(fields)) + 1;
+		if (!site.id.compare_exchange_strong(expected, id, std::memory_order_acq_rel))
+			id = expected; // registered by other thread at the same time
+	}
+	BinlogEncoder& enc(BinlogEncoder::forThread());
+	enc.begin(id - 1, site.level);
+	enc.putThread();
+	structlog_fields(enc, fields...);
+	enc.submit();
+}
+
+#define LVLBLOG(lvl, fmt, ...) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isOutput(lvl)) { \
+	static std::uint32_t const __bmu_binlog_id = ::bmu::registerBinlogFormat(lvl, fmt, SOURCE_SITE.file, __LINE__); \
+	::bmu::binlog(lvl, __bmu_binlog_id, ##__VA_ARGS__); }
+#define ERRBLOG(fmt, ...) LVLBLOG(::bmu::LERROR, fmt, ##__VA_ARGS__);
+#define WARNBLOG(fmt, ...) LVLBLOG(::bmu::LWARN, fmt, ##__VA_ARGS__);
+#define INFOBLOG(fmt, ...) LVLBLOG(::bmu::LINFO, fmt, ##__VA_ARGS__);
+#define TRACEBLOG(fmt, ...) LVLBLOG(::bmu::LTRACE, fmt, ##__VA_ARGS__);
+#define DUMPBLOG(fmt, ...) LVLBLOG(::bmu::LDUMP, fmt, ##__VA_ARGS__);
+/// Structured record, e.g. INFOSLOG("request done", bmu::field("user", id), bmu::field("latency", ms)).
+/// Scalar fields are encoded without heap allocation. Time, thread id and thread name are fields time,
+/// thread and threadname. Text outputs write it as \ref structformat_e, binary log unformatted.
+#define LVLSLOG(lvl, msg, ...) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isOutput(lvl)) { \
+	static ::bmu::StructlogSite __bmu_structlog_site(lvl, msg, SOURCE_SITE.file, __LINE__); \
+	::bmu::structlog(__bmu_structlog_site, ##__VA_ARGS__); }
+#define ERRSLOG(msg, ...) LVLSLOG(::bmu::LERROR, msg, ##__VA_ARGS__);
+#define WARNSLOG(msg, ...) LVLSLOG(::bmu::LWARN, msg, ##__VA_ARGS__);
+#define INFOSLOG(msg, ...) LVLSLOG(::bmu::LINFO, msg, ##__VA_ARGS__);
+#define TRACESLOG(msg, ...) LVLSLOG(::bmu::LTRACE, msg, ##__VA_ARGS__);
+#define DUMPSLOG(msg, ...) LVLSLOG(::bmu::LDUMP, msg, ##__VA_ARGS__);
+}
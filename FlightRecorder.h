@@ -0,0 +1,24 @@
+#pragma once
+#include <bmu/Logger.h>
+#include <string>
+
+namespace beam_me_up {
+
+/// Flight recorder keeps recent lines of std::wclog, std::clog and thread logs of every thread in
+/// its own fixed-size ring, also lines of levels up to given level which are disabled for output
+/// (\see logmanip::isOutput). Keeping a line costs one copy (wide lines are converted to UTF-8).
+/// On SIGSEGV, SIGABRT, SIGBUS, SIGFPE and SIGILL the rings and records which are still in writer
+/// queues are written to crashfile with async-signal-safe calls only, then the previous handler runs.
+/// Deferred (binary) records are kept only as far as they are in writer queues.
+///
+/// Crash file is UTF-8 text:
+///   **** flight recorder, signal N ****
+///   ---- thread N ---- (ring of one thread, "finished" for thread which ended)
+///   ---- not written yet ---- (text records queued for backends)
+bool installFlightRecorder(std::wstring const& crashfile, loglevel_e level = LTRACE, size_t ringbytes = 64 * 1024);
+/// Previous signal handlers are restored, rings are kept for threads which already have them
+void uninstallFlightRecorder(void);
+/// Writes the same content as signal handler, e.g. when fatal error is handled without signal
+bool dumpFlightRecorder(std::wstring const& filename);
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <bmu/Logger.h>
+#include <string>
+#include <type_traits>
+
+namespace beam_me_up {
+
+/// Formatted logging with {} placeholders, e.g. INFOFLOG("request {} took {} ms", id, ms). Format is
+/// UTF-8 string literal, {{ and }} are literal braces. Number of placeholders is checked against
+/// number of arguments at compile time. Record is written into per-thread UTF-8 buffer without
+/// std::wostream, so there is no locale, sentry or widening of narrow strings, and it's given
+/// to the clog writer in one call. Output of arguments is the same as of \ref LVLBLOG.
+
+/// Number of {} in format or -1 if it has single { or }. Literal is checked character by
+/// character so it has to be shorter than constexpr depth of compiler (512 by default).
+constexpr int format_placeholders(char const* f, int count = 0)
+{
+	return !*f ? count
+		: ('{' == f[0] && '{' == f[1]) || ('}' == f[0] && '}' == f[1]) ? format_placeholders(f + 2, count)
+		: '{' == f[0] && '}' == f[1] ? format_placeholders(f + 2, count + 1)
+		: '{' == f[0] || '}' == f[0] ? -1
+		: format_placeholders(f + 1, count);
+}
+
+/// Number of arguments as type, only used in decltype \see LVLFLOG
+template<typename... _Args>
+std::integral_constant<int, sizeof...(_Args)> format_arg_count(_Args const&...);
+
+/// Per-thread UTF-8 record, buffer is reused for every record of the thread.
+class FormatRecord {
+	FormatRecord(FormatRecord const&) = delete;
+	void operator = (FormatRecord const&) = delete;
+	FormatRecord(void)
+		: level(LINFO)
+	{ }
+public:
+	static FormatRecord& forThread(void);
+	/// Starts record with level prefix as LVLCLOG writes it
+	void begin(loglevel_e lvl);
+	/// Completes line and gives it to flight recorder and clog writer
+	void submit(void);
+	/// Appends format up to next {} without {{ and }} escapes, returns position after {}
+	char const* literal(char const* f);
+	template<typename _T>
+	typename std::enable_if<std::is_integral<_T>::value && std::is_signed<_T>::value>::type put(_T v)
+	{
+		putSigned((long long)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_integral<_T>::value && !std::is_signed<_T>::value>::type put(_T v)
+	{
+		putUnsigned((unsigned long long)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_floating_point<_T>::value>::type put(_T v)
+	{
+		putDouble((double)v);
+	}
+	template<typename _T>
+	typename std::enable_if<std::is_enum<_T>::value>::type put(_T v)
+	{
+		putSigned((long long)v);
+	}
+	/// Codepoint (Latin-1 for non-ASCII byte) written as UTF-8, same as LVLBLOG argument
+	void put(char v);
+	void put(wchar_t v);
+	void put(void const* v);
+	void put(bool v)
+	{
+		text.append(v ? "true" : "false");
+	}
+	void put(char const* s)
+	{
+		text.append(s ? s : "(null)");
+	}
+	void put(std::string const& s)
+	{
+		text.append(s);
+	}
+	void put(wchar_t const* s);
+	void put(std::wstring const& s);
+private:
+	void putSigned(long long v);
+	void putUnsigned(unsigned long long v);
+	void putDouble(double v);
+	std::string text;
+	loglevel_e  level;
+};
+
+inline void format_args(FormatRecord& rec, char const* f)
+{
+	rec.literal(f);
+}
+
+template<typename _T, typename... _Args>
+inline void format_args(FormatRecord& rec, char const* f, _T const& v, _Args const&... args)
+{
+	f = rec.literal(f);
+	rec.put(v);
+	format_args(rec, f, args...);
+}
+
+template<typename... _Args>
+inline void formatlog(loglevel_e lvl, char const* fmt, _Args const&... args)
+{
+	FormatRecord& rec(FormatRecord::forThread());
+	rec.begin(lvl);
+	format_args(rec, fmt, args...);
+	rec.submit();
+}
+
+#define LVLFLOG(lvl, fmt, ...) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isEnabled(lvl)) { \
+	static_assert(::bmu::format_placeholders(fmt) >= 0, "single { or } in format, use {{ or }}"); \
+	static_assert(::bmu::format_placeholders(fmt) == decltype(::bmu::format_arg_count(__VA_ARGS__))::value, "number of {} differs from number of arguments"); \
+	::bmu::formatlog(lvl, fmt, ##__VA_ARGS__); }
+#define ERRFLOG(fmt, ...) LVLFLOG(::bmu::LERROR, fmt, ##__VA_ARGS__);
+#define WARNFLOG(fmt, ...) LVLFLOG(::bmu::LWARN, fmt, ##__VA_ARGS__);
+#define INFOFLOG(fmt, ...) LVLFLOG(::bmu::LINFO, fmt, ##__VA_ARGS__);
+#define TRACEFLOG(fmt, ...) LVLFLOG(::bmu::LTRACE, fmt, ##__VA_ARGS__);
+#define DUMPFLOG(fmt, ...) LVLFLOG(::bmu::LDUMP, fmt, ##__VA_ARGS__);
+}
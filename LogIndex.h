@@ -0,0 +1,60 @@
+#pragma once
+#include <bmu/Logger.h>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace beam_me_up {
+
+/// Sidecar index of clog file (\see FileBatching::indexrecords) is file name with .idx which starts with
+/// "BMUIDX01" and has entries in native byte order, sorted by both members. Entries are written after
+/// the lines they point to, the last one when the file is closed has its size.
+char const logindex_magic[8] = { 'B', 'M', 'U', 'I', 'D', 'X', '0', '1' };
+
+struct LogIndexEntry {
+	std::uint64_t ns; ///< write time of the record since epoch, not time in its prefix
+	std::uint64_t offset; ///< of the record in the file
+};
+
+/// Read only memory mapping of the whole file
+class MappedFile {
+	MappedFile(MappedFile const&) = delete;
+	void operator = (MappedFile const&) = delete;
+public:
+	MappedFile(void);
+	~MappedFile();
+	bool open(std::wstring const& filename);
+	void close(void);
+	char const* data(void) const
+	{
+		return addr;
+	}
+	size_t size(void) const
+	{
+		return length;
+	}
+private:
+	char const* addr;
+	size_t      length;
+#ifdef _WIN32
+	void*       mapping;
+#endif
+};
+
+/// Part of one clog file
+struct LogRange {
+	std::wstring       filename;
+	unsigned long long begin;
+	unsigned long long end;
+};
+
+/// Ranges of the files with every line logged in [from, to], in order of time of the files. Files can
+/// be any rotated set from one setClogOutput, files without index are skipped. Index has write times
+/// of records, which come after their time in the prefix, so ranges end at index entry after
+/// to + latency. Ranges also contain some lines logged before from and after to, as many as
+/// FileBatching::indexrecords or indexbytes at most. Each index is mapped and binary searched.
+std::vector<LogRange> findLogRanges(std::vector<std::wstring> const& filenames, std::chrono::system_clock::time_point from,
+	std::chrono::system_clock::time_point to, std::chrono::milliseconds latency = std::chrono::milliseconds(1000));
+
+}
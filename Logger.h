@@ -2,6 +2,14 @@
 #include <string>
 #include <iostream>
 #include <list>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 #include <bmu/single_shared.hxx>
 
 namespace beam_me_up {}
@@ -19,6 +27,8 @@ inline std::wostream& operator<<(std::wostream& os, ::std::basic_string<std::uin
 
 namespace beam_me_up {
 
+using ::operator<<; // operators above would be hidden by operators declared in this namespace
+
 typedef std::shared_ptr<std::wstreambuf> StdBufPtr;
 
 /// Modifikator na početku ispisivanja svakog reda u
@@ -53,38 +63,114 @@ typedef std::shared_ptr<LogScope> LogScopePtr;
 /// parent loglevel ima prioritet (od tekuceg manipulatora se kroz stablo ide do root ili prvog predaka ciji loglevel ponistava loglevel tekuceg manipulatora)
 /// efekat zadnjeg manipulatora vazi dok se ne proslijedi novi manipulator
 /// efekat root manipulator vazi u startu dok se ne proslijedi novi
+/// Every scope holds its effective loglevel (own or inherited), changes are pushed down to children
+/// without own loglevel so checking is a single relaxed load.
 class LogScope : public std::enable_shared_from_this<LogScope> {
 	LogScope(void) = delete;
 	LogScope(LogScope const&) = delete;
 	void operator = (LogScope const&) = delete;
 	LogScope(LogScopePtr parent);
 public:
+	~LogScope();
 	static LogScopePtr create(LogScopePtr parent);
 	void setLoglevel(loglevel_e newlevel);
-	bool isEnabled(loglevel_e wanted);
+	/// Scope again inherits loglevel from parent
+	void resetLoglevel(void);
+	bool isEnabled(loglevel_e wanted) const
+	{
+		return wanted <= effective.load(std::memory_order_relaxed);
+	}
 private:
-	LogScopePtr parent;
-	LogLevelPtr level;
+	friend class logmanip;
+	void propagate(int efflevel);
+	LogScopePtr            parent;
+	std::vector<LogScope*> children; // children unregister in destructor, guarded by tree mutex
+	bool                   haslevel;
+	loglevel_e             level;
+	std::atomic<int>       effective;
 };
 
 class logmanip {
 public:
 	enum type_e { indent, unindent };
+	/// Level prefix of a line, \see level
+	struct level_t {
+		loglevel_e lvl;
+		bool       prefix;
+	};
 private:
 	friend std::wostream& operator<<(std::wostream& os, logmanip::type_e m);
 	friend std::wostream& operator<<(std::wostream& os, LogScopePtr new_scope);
+	friend std::ostream& operator<<(std::ostream& os, logmanip::type_e m);
+	friend std::ostream& operator<<(std::ostream& os, LogScopePtr new_scope);
+	friend std::wostream& operator<<(std::wostream& os, logmanip::level_t l);
+	friend std::ostream& operator<<(std::ostream& os, logmanip::level_t l);
 	friend class LoggerSink;
 	friend class LogsFactoryImpl;
+	friend class LogScope;
+	friend class FlightRecorder;
+	friend class PrefixLayout;
+	friend class FormatRecord;
 public:
 	static void setThreadName(std::wstring const&);
-	static bool isEnabled(loglevel_e wanted);
+	static std::wstring const& getThreadName(void);
+	/// Uses effective loglevel of current scope and level kept by flight recorder, wait-free
+	static bool isEnabled(loglevel_e wanted)
+	{
+		return wanted <= enabled_level.load(std::memory_order_relaxed);
+	}
+	/// Level is written to outputs or sinks, lines enabled only for flight recorder aren't \see installFlightRecorder
+	static bool isOutput(loglevel_e wanted)
+	{
+		return wanted <= queued_level.load(std::memory_order_relaxed);
+	}
+	/// Level is written to terminal, clog, thread or binary log files and not only to sinks \see LogsFactoryBase::setOutputLevel
+	static bool isPrimaryOutput(loglevel_e wanted)
+	{
+		return wanted <= output_level.load(std::memory_order_relaxed);
+	}
+	/// Writes level prefix and remembers level of the line for writer's overflow policy \see QueuePolicy
+	static level_t level(loglevel_e lvl, bool prefix = true)
+	{
+		return level_t{ lvl, prefix };
+	}
+	/// Level of the line which this thread is writing, LINFO if it wasn't given with \ref level
+	static loglevel_e lineLevel(void)
+	{
+		return line_level;
+	}
+	/// False if level of the line which this thread is writing is kept only by flight recorder
+	static bool lineOutput(void)
+	{
+		return line_output;
+	}
+	/// Called when the line is given to writer
+	static void endLine(void)
+	{
+		line_level = LINFO;
+		line_output = true;
+	}
 private:
 	static void update(logmanip::type_e);
-	static LogModifierFn getLogModifierIndentation(void);
-	static LogModifierFn getLogModifierThreadname(void);
+	static void setScope(LogScopePtr new_scope);
 	static std::shared_ptr<SharedThreadStr> indentation_str;
 	static std::shared_ptr<SharedThreadStr> threadname_str;
-	static LogScopePtr                      current_scope;
+	static LogScopePtr                      current_scope; // ensures lifetime, guarded by tree mutex
+	/// Both levels are changed only under lock of LogScope tree
+	static void storeLevels(int scopelevel, int recorderlevel);
+	/// -1 when flight recorder is uninstalled
+	static void setRecorderLevel(int recorderlevel);
+	/// Limit of primary outputs and the most verbose maxlevel of sinks, -1 without sinks
+	static void setOutputLevels(int outputlevel, int sinklevel);
+	static std::atomic<int>                 current_level; // effective loglevel of current_scope
+	static std::atomic<int>                 output_level; // the less verbose of current_level and output_maxlevel
+	static std::atomic<int>                 queued_level; // the more verbose of output_level and sink_maxlevel
+	static std::atomic<int>                 enabled_level; // the more verbose of queued_level and recorder_level
+	static int                              recorder_level; // -1 without flight recorder
+	static int                              output_maxlevel;
+	static int                              sink_maxlevel; // -1 without sinks
+	static thread_local loglevel_e          line_level;
+	static thread_local bool                line_output;
 };
 
 inline std::wostream& operator<<(std::wostream& os, logmanip::type_e m)
@@ -95,21 +181,207 @@ inline std::wostream& operator<<(std::wostream& os, logmanip::type_e m)
 
 inline std::wostream& operator<<(std::wostream& os, LogScopePtr new_scope)
 {
-	logmanip::current_scope = new_scope;
+	logmanip::setScope(new_scope);
+	return os;
+}
+
+inline std::wostream& operator<<(std::wostream& os, logmanip::level_t l)
+{
+	logmanip::line_level = l.lvl;
+	logmanip::line_output = logmanip::isOutput(l.lvl);
+	return l.prefix ? os << to_string(l.lvl) : os;
+}
+
+inline std::ostream& operator<<(std::ostream& os, logmanip::level_t l)
+{
+	logmanip::line_level = l.lvl;
+	logmanip::line_output = logmanip::isOutput(l.lvl);
+	return l.prefix ? os << to_string(l.lvl) : os;
+}
+
+inline std::ostream& operator<<(std::ostream& os, logmanip::type_e m)
+{
+	logmanip::update(m);
+	return os;
+}
+
+inline std::ostream& operator<<(std::ostream& os, LogScopePtr new_scope)
+{
+	logmanip::setScope(new_scope);
 	return os;
 }
 
+/// When written clog file data is forced to the disk \see FileBatching
+enum datasync_e {
+	DATASYNC_NONE, ///< (default) left to the operating system
+	DATASYNC_BATCH, ///< after every written batch
+	DATASYNC_IDLE, ///< when backend has written all queued lines
+};
+
+/// Clog file output is collected and written with one system call per batch. Batch is written when
+/// backend has written all queued lines, when it has maxbytes or when its oldest line waited maxdelayms.
+///
+/// With indexrecords or indexbytes every file gets sidecar index (file name with .idx) with write time
+/// of its first record and then of record after indexrecords records or indexbytes bytes since the
+/// previous entry \see findLogRanges
+struct FileBatching {
+	size_t       maxbytes = 64 * 1024;
+	unsigned int maxdelayms = 100; ///< 0 for no time limit
+	datasync_e   datasync = DATASYNC_NONE;
+	size_t       indexrecords = 0; ///< 0 for no limit, no index when both are 0
+	size_t       indexbytes = 0; ///< 0 for no limit
+};
+
+/// What producer does when writer's queue is full \see QueuePolicy
+enum overflow_e {
+	OVERFLOW_BLOCK, ///< (default) waits until backend makes room
+	OVERFLOW_DROP_NEWEST, ///< record which doesn't fit is dropped
+	OVERFLOW_DROP_OLDEST, ///< producer drops the oldest queued record without writing it
+	OVERFLOW_DROP_BELOW_LEVEL, ///< records less important than keeplevel are dropped, others wait
+};
+
+/// Queue of every writer (terminal, clog file, binary log). Dropped records are counted and
+/// backend reports them with "N log records dropped" line at most once per dropreportms.
+///
+/// With coalescebytes std::endl only ends a line, lines of a thread are collected and queued as one
+/// record when they reach coalescebytes, when line of other level comes or by backend when the oldest
+/// one waited coalescems. \ref LogsFactoryBase::flush queues them at once. Sinks still get single lines.
+struct QueuePolicy {
+	size_t       capacity = 8192; ///< number of records, used for writers created afterwards
+	overflow_e   overflow = OVERFLOW_BLOCK;
+	loglevel_e   keeplevel = LWARN;
+	unsigned int dropreportms = 1000;
+	size_t       coalescebytes = 0; ///< 0 queues every line at std::endl
+	unsigned int coalescems = 20;
+};
+
+/// Threads of backends: one per writer (terminal, clog file, binary log) and optional sink workers,
+/// so slow sink doesn't delay files. Every sink is written by one worker, its lines stay in order.
+struct BackendPolicy {
+	size_t           sinkworkers = 0; ///< 0 writes sinks from backends of writers
+	std::vector<int> cpus; ///< backend threads run only on these CPUs (up to 64 on Windows), empty for any
+	int              priority = 0; ///< -2..2 relative to the priority thread started with, raising may need privileges
+};
+
+/// How structured records (\see LVLSLOG) are written to text outputs, binary log keeps them unformatted
+enum structformat_e {
+	STRUCTFORMAT_LOGFMT, ///< (default) time=... level=info msg="..." key=value
+	STRUCTFORMAT_JSON, ///< one JSON object per line
+};
+
+/// Distribution of one measured quantity. Bucket 0 counts zeros, bucket i counts values in [2^(i-1), 2^i).
+struct LogHistogram {
+	static size_t const buckets = 64;
+	unsigned long long counts[buckets] = {};
+	unsigned long long samples = 0;
+	unsigned long long sum = 0;
+	unsigned long long max = 0;
+	/// Upper bound of the bucket below which given fraction (0..1) of samples is, e.g. 0.99
+	unsigned long long percentile(double fraction) const;
+};
+
+/// Counters of one writer since it was created \see LogsFactoryBase::getStats
+struct LogWriterStats {
+	std::string        name; ///< "terminal", "clog file" or "binlog"
+	size_t             queuedepth = 0; ///< records waiting for backend
+	size_t             queuecapacity = 0;
+	unsigned long long records = 0; ///< written by backend
+	unsigned long long bytes = 0; ///< written to the sink, for binary log octets of records
+	unsigned long long dropped = 0; ///< \see QueuePolicy
+	unsigned long long rotations = 0;
+	LogHistogram       latencyns; ///< from enqueue by producer to write by backend
+	LogHistogram       batchrecords; ///< records written in one wake up of backend
+	LogHistogram       batchns; ///< duration of one wake up of backend including flush
+	LogHistogram       rotationns; ///< opening of the next file ahead and switching to it
+	LogHistogram       waitns; ///< producer waiting for free cell of full queue, push has no lock
+};
+
+/// Additional destination of clog records \see LogsFactoryBase::setSink. Every record is formatted
+/// once by producer and the same UTF-8 line (prefix, message and newline) is given to every sink
+/// whose level allows it. Sinks are called only from backend threads of clog writers or from their
+/// sink worker \see BackendPolicy::sinkworkers.
+class LogSink {
+public:
+	virtual ~LogSink()
+	{ }
+	virtual void write(char const* line, size_t n, loglevel_e lvl) = 0;
+	/// Backend has written all queued records
+	virtual void flush(void)
+	{ }
+};
+
+typedef std::shared_ptr<LogSink> LogSinkPtr;
+
+/// Keeps last lines in memory, e.g. to be shown or attached to error report
+class LogRingSink : public LogSink {
+public:
+	explicit LogRingSink(size_t maxlines);
+	void write(char const* line, size_t n, loglevel_e lvl);
+	/// From the oldest one
+	std::vector<std::string> lines(void) const;
+private:
+	mutable std::mutex       mutex;
+	std::vector<std::string> ring; // strings keep capacity when overwritten
+	size_t                   next;
+	size_t                   used;
+};
+
+typedef std::shared_ptr<LogRingSink> LogRingSinkPtr;
+
+/// Sink writing to streambuf which outlives it, e.g. std::cerr.rdbuf() for console
+LogSinkPtr createStreambufSink(std::streambuf* sbuf);
+/// Sink writing to the file in batches \see FileBatching. Null if file can't be opened.
+LogSinkPtr createFileSink(std::wstring const& filename, FileBatching const& batching = FileBatching());
+
+class LogsFactoryImpl;
+
 class LogsFactoryBase {
 protected:
 	LogsFactoryBase(void);
 public:
 	~LogsFactoryBase();
+	/// Library modifiers (logmod_date, logmod_time, ...) become fields of compiled layout (\see setPrefixLayout),
+	/// the others are called for every line. Indentation and thread name follow them.
 	void setModifiers(std::list<LogModifierFn> modifiers);
+	/// Prefix of every line from pattern compiled once. %D date, %T time, %us fraction of the second
+	/// as logmod_time writes it (nanoseconds modulo 10^6 without leading zeros), %DT short date and time, %tid thread id, %tname thread name, %indent indentation,
+	/// %% percent sign, other characters are copied. e.g. L"%D %T.%us [%tid] %tname %indent"
+	void setPrefixLayout(std::wstring const& pattern);
 	void setClogRotationSize(size_t bymax);
+	/// Used for clog files opened afterwards (\ref setClogOutput and rotation)
+	void setClogFileBatching(FileBatching const& batching);
+	/// Overflow policy is changed for all writers, capacity only for writers created afterwards
+	void setQueuePolicy(QueuePolicy const& policy);
+	/// Lines collected by all threads (\see QueuePolicy::coalescebytes) are queued for backends
+	void flush(void);
+	/// Like flush, and waits until backends and sink workers have written and flushed every record queued
+	/// before the call. Not from sinks. With stalled sink it waits for the sink.
+	void drain(void);
+	/// Records dropped because of \ref QueuePolicy since start
+	unsigned long long getDroppedRecords(void);
+	/// Snapshot of counters of current writers. Producers update only per-thread shards and
+	/// only when their queue is full, backend counters have single writer, so they are always on.
+	std::vector<LogWriterStats> getStats(void);
+	/// Terminal, clog, thread and binary log files get records of maxlevel and more important ones which
+	/// pass the scope level, LDUMP leaves it to the scope. Sinks have their own levels (\see setSink).
+	void setOutputLevel(loglevel_e maxlevel);
+	/// Adds or replaces named sink which gets clog records of maxlevel and more important ones, regardless
+	/// of scope and output level, e.g. LTRACE ring enables LTRACE lines which outputs don't write.
+	/// With sink workers the sink is written by worker % sinkworkers, or one chosen by name for -1.
+	void setSink(std::string const& name, LogSinkPtr sink, loglevel_e maxlevel, int worker = -1);
+	void removeSink(std::string const& name);
+	/// Applies to current and future backend threads. Sinks move to new workers when their number
+	/// changes, old workers write lines they already have.
+	void setBackendPolicy(BackendPolicy const& policy);
 	/// Postavlja zadani fajl kao izlaz. Za filename.empty izlaz je terminal
+	/// Output of std::wclog and std::clog is UTF-8, std::clog text is written without conversion.
 	void setClogOutput(std::wstring const& filename);
 	/// Postavlja zadani fajl kao izlaz. Za filename.empty se ponistava i sav ispis ide u std::wclog
 	void setTlogOutputPrefix(std::wstring const& filename_prefix);
+	/// Deferred records (\see BinLog.h) are written unformatted to the file. For filename.empty they are formatted into clog output.
+	void setBinlogOutput(std::wstring const& filename);
+	/// Applies to structured records formatted by backends from now on
+	void setStructuredFormat(structformat_e format);
 	std::wostream& getTlogOutput(void);
 private:
 	std::shared_ptr<LogsFactoryImpl> _impl;
@@ -118,6 +390,133 @@ private:
 typedef bmu::single_shared<LogsFactoryBase> LogsFactory;
 typedef std::shared_ptr<LogsFactory> LogsFactoryPtr;
 
+/// State of one call site of rate limited logging macros (\ref LVLCLOG_EVERY_N and others).
+/// Each check gives true if the call should log and then suppressed is number of calls
+/// suppressed since previous logged one. Suppressed call is a relaxed atomic increment.
+class LogSite {
+	LogSite(LogSite const&) = delete;
+	void operator = (LogSite const&) = delete;
+public:
+	constexpr LogSite(void)
+		: calls(0)
+		, logged(0)
+		, next(0)
+	{ }
+	/// 1st, (n+1)th, (2n+1)th... call
+	bool everyN(unsigned long long& suppressed, unsigned long long n)
+	{
+		unsigned long long const c = calls.fetch_add(1, std::memory_order_relaxed);
+		if (n > 1 && c % n)
+			return false;
+		suppressed = c && n > 1 ? n - 1 : 0;
+		return true;
+	}
+	/// First n calls
+	bool firstN(unsigned long long& suppressed, unsigned long long n)
+	{
+		suppressed = 0;
+		return calls.fetch_add(1, std::memory_order_relaxed) < n;
+	}
+	/// At most once per given seconds, suppressed call also reads steady clock
+	bool everyT(unsigned long long& suppressed, double seconds)
+	{
+		unsigned long long const c = calls.fetch_add(1, std::memory_order_relaxed);
+		long long const now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		long long due = next.load(std::memory_order_relaxed);
+		if (now < due || !next.compare_exchange_strong(due, now + (long long)(seconds * 1e9), std::memory_order_relaxed))
+			return false;
+		suppressed = c - logged.exchange(c + 1, std::memory_order_relaxed);
+		return true;
+	}
+	/// Random calls with given probability
+	bool sampled(unsigned long long& suppressed, double probability)
+	{
+		if ((double)(randomForThread() >> 11) * (1.0 / 9007199254740992.0) >= probability) {
+			calls.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		suppressed = calls.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+private:
+	/// xorshift64*, it's enough for sampling
+	static std::uint64_t randomForThread(void)
+	{
+		thread_local std::uint64_t state = 0;
+		if (!state) {
+			state = (std::uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (std::uint64_t)(std::uintptr_t)&state;
+			state |= 1;
+		}
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ull;
+	}
+	std::atomic<unsigned long long> calls;
+	std::atomic<unsigned long long> logged; // calls before the last logged one and itself, everyT
+	std::atomic<long long>          next; // steady clock nanoseconds when everyT logs again
+};
+
+/// Appended to rate limited line, writes nothing if no call was suppressed
+struct LogSuppressed {
+	unsigned long long n;
+};
+
+inline std::wostream& operator<<(std::wostream& os, LogSuppressed const& s)
+{
+	return s.n ? os << " [" << s.n << " suppressed]" : os;
+}
+
+inline std::ostream& operator<<(std::ostream& os, LogSuppressed const& s)
+{
+	return s.n ? os << " [" << s.n << " suppressed]" : os;
+}
+
+/// UTF-8 log stream (std::clog) as used by CLOG8 macros. Wide text is converted with
+/// codepoint_transform.hxx, everything else is written by the stream. Only this wrapper has operators
+/// for wide text, other narrow streams of the program are left as they are.
+class Utf8Log {
+public:
+	explicit Utf8Log(std::ostream& os)
+		: os(os)
+	{ }
+	template<typename _T>
+	Utf8Log& operator<<(_T const& val)
+	{
+		os << val;
+		return *this;
+	}
+	Utf8Log& operator<<(std::ostream& (*manip)(std::ostream&))
+	{
+		manip(os);
+		return *this;
+	}
+	Utf8Log& operator<<(std::ios_base& (*manip)(std::ios_base&))
+	{
+		manip(os);
+		return *this;
+	}
+	Utf8Log& operator<<(wchar_t c)
+	{
+		return write(&c, 1);
+	}
+	Utf8Log& operator<<(wchar_t const* s)
+	{
+		return s ? write(s, std::char_traits<wchar_t>::length(s)) : *this;
+	}
+	Utf8Log& operator<<(wchar_t* s)
+	{
+		return *this << (wchar_t const*)s;
+	}
+	Utf8Log& operator<<(std::wstring const& s)
+	{
+		return write(s.data(), s.size());
+	}
+private:
+	Utf8Log& write(wchar_t const* s, size_t n);
+	std::ostream& os;
+};
+
 struct tlog_tag { };
 extern tlog_tag  tlog;
 template<typename _T>
@@ -132,31 +531,117 @@ std::string srcpos_full(unsigned int line, std::string const& function, std::str
 /// Slično kao \ref srcpos_full samo sto se iz file izdvoji name bez patha.
 std::string srcpos_short(unsigned int line, std::string const& function, std::string const& file);
 
+constexpr size_t srcpos_later(size_t a, size_t b)
+{
+	return a > b ? a : b;
+}
+
+/// Offset of file name after last slash in path[begin, end). Halving keeps recursion depth at log2
+/// of path length so it stays in compiler's constexpr limits for any __FILE__.
+constexpr size_t srcpos_basename_offset(char const* path, size_t begin, size_t end)
+{
+	return end - begin > 1
+		? srcpos_later(srcpos_basename_offset(path, begin, begin + (end - begin) / 2), srcpos_basename_offset(path, begin + (end - begin) / 2, end))
+		: end - begin == 1 && ('/' == path[begin] || '\\' == path[begin]) ? begin + 1 : 0;
+}
+
+/// Position in source code computed at compile time, \see SOURCE_SITE. Written to log streams as
+/// {function} in [file](line), same as \ref srcpos_short but without building strings.
+struct SourceSite {
+	char const*  file; ///< without path
+	char const*  function;
+	unsigned int line;
+};
+
+template<typename _Char>
+inline std::basic_ostream<_Char>& operator<<(std::basic_ostream<_Char>& os, SourceSite const& site)
+{
+	return os << "{" << site.function << "} in [" << site.file << "](" << std::dec << site.line << ")";
+}
+
+template<typename _Char>
+inline std::basic_ostream<_Char>& operator<<(std::basic_ostream<_Char>& os, SourceSite const* site)
+{
+	return site ? os << *site : os;
+}
+
+/// Logs entering and leaving of the scope at LTRACE level into thread's log, \see TRACE_HERE
+class Tracer {
+	Tracer(Tracer const&) = delete;
+	void operator = (Tracer const&) = delete;
+public:
+	explicit Tracer(SourceSite const* site);
+	~Tracer();
+private:
+	SourceSite const* site;
+};
+
+/// Most verbose level compiled in. Logging calls above it (e.g. LTRACE and LDUMP for ::bmu::LINFO) are
+/// removed at compile time together with their arguments. Can be defined per build or before including
+/// Logger.h in translation unit.
+#ifndef BMU_LOG_COMPILED_LEVEL
+# define BMU_LOG_COMPILED_LEVEL ::bmu::LDUMP
+#endif
+#define BMU_LOG_IS_COMPILED(lvl) ((lvl) <= BMU_LOG_COMPILED_LEVEL)
+
 #define LOGMSG(str) std::wclog << str << std::endl;
-#define LVLCLOG(lvl, str) if(::bmu::logmanip::isEnabled(lvl)) { std::wclog << ::bmu::to_string(lvl) << str << std::endl; }
+#define LVLCLOG(lvl, str) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isEnabled(lvl)) { std::wclog << ::bmu::logmanip::level(lvl) << str << std::endl; }
 #define ERRCLOG(str) LVLCLOG(::bmu::LERROR, str);
 #define WARNCLOG(str) LVLCLOG(::bmu::LWARN, str);
 #define INFOCLOG(str) LVLCLOG(::bmu::LINFO, str);
 #define TRACECLOG(str) LVLCLOG(::bmu::LTRACE, str);
 #define DUMPCLOG(str) LVLCLOG(::bmu::LDUMP, str);
-#define LVLTLOG(lvl, str) if(::bmu::logmanip::isEnabled(lvl)) { \
+/// Same as CLOG macros but for narrow std::clog, text is UTF-8 and goes to the same output without conversion
+#define LVLCLOG8(lvl, str) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isEnabled(lvl)) { ::bmu::Utf8Log(std::clog) << ::bmu::logmanip::level(lvl) << str << std::endl; }
+#define ERRCLOG8(str) LVLCLOG8(::bmu::LERROR, str);
+#define WARNCLOG8(str) LVLCLOG8(::bmu::LWARN, str);
+#define INFOCLOG8(str) LVLCLOG8(::bmu::LINFO, str);
+#define TRACECLOG8(str) LVLCLOG8(::bmu::LTRACE, str);
+#define DUMPCLOG8(str) LVLCLOG8(::bmu::LDUMP, str);
+#define LVLTLOG(lvl, str) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isEnabled(lvl)) { \
 	if(::bmu::LogsFactoryPtr lp = ::bmu::LogsFactory::instance()) { \
-		lp->getTlogOutput() << str << std::endl; \
+		lp->getTlogOutput() << ::bmu::logmanip::level(lvl, false) << str << std::endl; \
 	} }
 #define ERRTLOG(str) LVLTLOG(::bmu::LERROR, str);
 #define WARNTLOG(str) LVLTLOG(::bmu::LWARN, str);
 #define INFOTLOG(str) LVLTLOG(::bmu::LINFO, str);
 #define TRACETLOG(str) LVLTLOG(::bmu::LTRACE, str);
 #define DUMPTLOG(str) LVLTLOG(::bmu::LDUMP, str);
+/// Rate limited logging, call site is checked (\see LogSite) only when level is enabled. out is stream
+/// expression which may be preceded by if. Number of suppressed calls is appended to the logged line.
+#define BMU_LIMITEDLOG(lvl, check, arg, out, str) if(BMU_LOG_IS_COMPILED(lvl) && ::bmu::logmanip::isEnabled(lvl)) { \
+	static ::bmu::LogSite __bmu_log_site; \
+	unsigned long long __bmu_suppressed = 0; \
+	if(__bmu_log_site.check(__bmu_suppressed, arg)) { \
+		out << str << ::bmu::LogSuppressed{ __bmu_suppressed } << std::endl; \
+	} }
+#define BMU_CLOG_OUT(lvl) std::wclog << ::bmu::logmanip::level(lvl)
+#define BMU_CLOG8_OUT(lvl) ::bmu::Utf8Log(std::clog) << ::bmu::logmanip::level(lvl)
+#define BMU_TLOG_OUT(lvl) if(::bmu::LogsFactoryPtr __bmu_lp = ::bmu::LogsFactory::instance()) __bmu_lp->getTlogOutput() << ::bmu::logmanip::level(lvl, false)
+#define LVLCLOG_EVERY_N(lvl, n, str) BMU_LIMITEDLOG(lvl, everyN, n, BMU_CLOG_OUT(lvl), str)
+#define LVLCLOG_FIRST_N(lvl, n, str) BMU_LIMITEDLOG(lvl, firstN, n, BMU_CLOG_OUT(lvl), str)
+#define LVLCLOG_EVERY_T(lvl, seconds, str) BMU_LIMITEDLOG(lvl, everyT, seconds, BMU_CLOG_OUT(lvl), str)
+#define LVLCLOG_SAMPLED(lvl, probability, str) BMU_LIMITEDLOG(lvl, sampled, probability, BMU_CLOG_OUT(lvl), str)
+#define LVLCLOG8_EVERY_N(lvl, n, str) BMU_LIMITEDLOG(lvl, everyN, n, BMU_CLOG8_OUT(lvl), str)
+#define LVLCLOG8_FIRST_N(lvl, n, str) BMU_LIMITEDLOG(lvl, firstN, n, BMU_CLOG8_OUT(lvl), str)
+#define LVLCLOG8_EVERY_T(lvl, seconds, str) BMU_LIMITEDLOG(lvl, everyT, seconds, BMU_CLOG8_OUT(lvl), str)
+#define LVLCLOG8_SAMPLED(lvl, probability, str) BMU_LIMITEDLOG(lvl, sampled, probability, BMU_CLOG8_OUT(lvl), str)
+#define LVLTLOG_EVERY_N(lvl, n, str) BMU_LIMITEDLOG(lvl, everyN, n, BMU_TLOG_OUT(lvl), str)
+#define LVLTLOG_FIRST_N(lvl, n, str) BMU_LIMITEDLOG(lvl, firstN, n, BMU_TLOG_OUT(lvl), str)
+#define LVLTLOG_EVERY_T(lvl, seconds, str) BMU_LIMITEDLOG(lvl, everyT, seconds, BMU_TLOG_OUT(lvl), str)
+#define LVLTLOG_SAMPLED(lvl, probability, str) BMU_LIMITEDLOG(lvl, sampled, probability, BMU_TLOG_OUT(lvl), str)
 #ifndef NDEBUG
-# define TRACE_HERE ::bmu::Tracer __scope_tracer_variable_name__(SOURCE_AT);
+# define TRACE_HERE static constexpr ::bmu::SourceSite __bmu_source_site = SOURCE_SITE; ::bmu::Tracer __scope_tracer_variable_name__(&__bmu_source_site);
 # define DBGMSG(str) LVLTLOG(::bmu::LTRACE, str)
-# define DBGMSGAT(str) DBGMSG("At " << SOURCE_AT << ": " << str)
+# define DBGMSGAT(str) do { static constexpr ::bmu::SourceSite __bmu_source_site = SOURCE_SITE; DBGMSG("At " << &__bmu_source_site << ": " << str) } while(0)
 #else
 # define TRACE_HERE
 # define DBGMSG(str) do { } while(0)
 # define DBGMSGAT(str) do { } while(0)
 #endif
+/// \ref SourceSite of the call, file name is stripped of path at compile time
+#define SOURCE_SITE (::bmu::SourceSite{ __FILE__ + std::integral_constant<size_t, ::bmu::srcpos_basename_offset(__FILE__, 0, sizeof(__FILE__) - 1)>::value, __FUNCTION__, __LINE__ })
+/// The same text as SOURCE_SITE as char const*, valid until the end of full expression
 #define SOURCE_AT (::bmu::srcpos_short(__LINE__, __FUNCTION__, __FILE__).c_str())
 #define FILE_AT __FILE__ ":" << __LINE__
 }
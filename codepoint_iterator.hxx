@@ -110,7 +110,6 @@ size_t putUTF16Words(u32char_t cp, _OutIt it, size_t const outWordsCount)
 	static_assert(sizeof(typename std::iterator_traits<_OutIt>::value_type) == 2, "Expected double-byte values");
 	if (cp > detail::MAX_CODEPOINT)
 		return 0;
-	unsigned n = 0;
 	if (cp > 0xffff) { //make a surrogate pair
 		if (outWordsCount < 2)
 			return 0;
@@ -1,5 +1,6 @@
 #pragma once
 #include "bmu/codepoint_iterator.hxx"
+#include <string>
 
 namespace beam_me_up {
 
@@ -37,7 +38,7 @@ size_t trMbyteToWide(_Octet it, _Octet const itend, _Word itresultbeg, _Word con
 	assert(itresultend - itresultbeg >= 2 * (itend - it));
 	_Word itresult = itresultbeg;
 	for (; it != itend; ) {
-		std::iterator_traits<_Word>::difference_type nOctets = 0;
+		typename std::iterator_traits<_Octet>::difference_type nOctets = 0;
 		u32char_t cp = getUTF8Codepoint(it, itend, nOctets);
 		if (cp == INVALID_CODEPOINT)
 			return -1;
@@ -58,8 +59,8 @@ size_t trMbyteToUni(_Octet it, _Octet const itend, _Dword itresultbeg, _Dword it
 	assert(itresultend - itresultbeg >= (itend - it));
 	_Dword itresult = itresultbeg;
 	for (; it != itend; ++itresult) {
-		std::iterator_traits<_Dword>::difference_type nOctets = 0;
-		unsigned __int32 cp = getUTF8Codepoint(it, itend, nOctets);
+		typename std::iterator_traits<_Octet>::difference_type nOctets = 0;
+		u32char_t cp = getUTF8Codepoint(it, itend, nOctets);
 		if (cp == INVALID_CODEPOINT)
 			return -1;
 		*itresult = cp;
@@ -84,4 +85,74 @@ size_t trUniToMbyte(_Dword it, _Dword const itend, _Octet itresultbeg, _Octet co
 	return itresult - itresultbeg;
 }
 
+//wchar_t holds UTF-16 words on Windows and UTF-32 codepoints elsewhere
+template<size_t _WideSize>
+struct wide_units;
+
+template<>
+struct wide_units<2> {
+	static u32char_t get(wchar_t const* it, wchar_t const* const end, std::ptrdiff_t& nWords)
+	{
+		return getUTF16Codepoint((u16unit_t const*)it, (u16unit_t const*)end, nWords);
+	}
+	static size_t put(u32char_t cp, wchar_t* it, size_t const outWordsCount)
+	{
+		return putUTF16Words(cp, (u16unit_t*)it, outWordsCount);
+	}
+};
+
+template<>
+struct wide_units<4> {
+	static u32char_t get(wchar_t const* it, wchar_t const* const /*end*/, std::ptrdiff_t& nWords)
+	{
+		nWords = 1;
+		return (u32char_t)*it;
+	}
+	static size_t put(u32char_t cp, wchar_t* it, size_t const outWordsCount)
+	{
+		if (cp > detail::MAX_CODEPOINT || outWordsCount < 1)
+			return 0;
+		*it = (wchar_t)cp;
+		return 1;
+	}
+};
+
+/// Appends UTF-8 octets of wide string, invalid codepoints are replaced with U+FFFD
+inline void appendWideAsUTF8(std::string& out, wchar_t const* s, size_t n)
+{
+	wchar_t const* const end = s + n;
+	while (s != end) {
+		if ((u32char_t)*s < 0x80) {
+			out.push_back((char)*s++);
+			continue;
+		}
+		std::ptrdiff_t nWords = 1;
+		u32char_t const cp = wide_units<sizeof(wchar_t)>::get(s, end, nWords);
+		if (0 == putUTF8Octets(cp, std::back_inserter(out)))
+			putUTF8Octets(0xfffdu, std::back_inserter(out));
+		s += nWords;
+	}
+}
+
+/// Appends wide characters of UTF-8 string, invalid octets are replaced with U+FFFD
+inline void appendUTF8AsWide(std::wstring& out, char const* s, size_t n)
+{
+	char const* const end = s + n;
+	while (s != end) {
+		if (0 == (*s & 0x80)) {
+			out.push_back((wchar_t)*s++);
+			continue;
+		}
+		std::ptrdiff_t nOctets = 1;
+		u32char_t cp = getUTF8Codepoint(s, end, nOctets);
+		if (INVALID_CODEPOINT == cp) {
+			cp = 0xfffdu;
+			nOctets = 1;
+		}
+		wchar_t w[2];
+		out.append(w, wide_units<sizeof(wchar_t)>::put(cp, w, 2));
+		s += nOctets;
+	}
+}
+
 }
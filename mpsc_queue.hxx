@@ -0,0 +1,154 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cassert>
+
+namespace beam_me_up {}
+namespace bmu = beam_me_up;
+
+namespace beam_me_up {
+
+//Bounded queue for many producers and single consumer. Cells are allocated once and reused so
+//values keep their capacity (e.g. std::wstring) and steady state pushing doesn't allocate.
+//Producers only reserve cell with CAS on enqueue_pos, there is no lock on any path.
+//Every cell has sequence number telling whether it is free for producer or ready for consumer.
+//Consumed cell is claimed with CAS on dequeue_pos the same way, so producer can pop the oldest
+//value to make room while consumer is busy with other one.
+template<typename _T>
+class bounded_mpsc_queue {
+	bounded_mpsc_queue(bounded_mpsc_queue const&) = delete;
+	void operator = (bounded_mpsc_queue const&) = delete;
+	struct cell {
+		std::atomic<size_t> seq;
+		_T                  value;
+	};
+	struct publisher {
+		cell&        c;
+		size_t const seq;
+		~publisher() // publish even if filling threw, otherwise consumer would stuck on this cell
+		{
+			c.seq.store(seq, std::memory_order_release);
+		}
+	};
+	static size_t round_capacity(size_t n)
+	{
+		size_t cap = 2;
+		while (cap < n)
+			cap <<= 1;
+		return cap;
+	}
+public:
+	/// Capacity is rounded up to power of two
+	explicit bounded_mpsc_queue(size_t capacity)
+		: mask(round_capacity(capacity) - 1)
+		, cells(new cell[mask + 1])
+		, enqueue_pos(0)
+		, dequeue_pos(0)
+	{
+		for (size_t i = 0; i <= mask; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+	size_t capacity(void) const
+	{
+		return mask + 1;
+	}
+	/// Reserves one cell and calls fill(_T&) to write value in place. False if queue is full.
+	template<typename _Fn>
+	bool try_push(_Fn&& fill)
+	{
+		cell* c = nullptr;
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			c = &cells[pos & mask];
+			size_t const seq = c->seq.load(std::memory_order_acquire);
+			std::intptr_t const dif = (std::intptr_t)seq - (std::intptr_t)pos;
+			if (0 == dif) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false; // full
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+		publisher pub{ *c, pos + 1 };
+		fill(c->value);
+		return true;
+	}
+	/// Calls consume(_T&) for the oldest value. False if queue is empty. Usually from consumer thread,
+	/// producer may drop the oldest value when queue is full.
+	template<typename _Fn>
+	bool try_pop(_Fn&& consume)
+	{
+		cell* c = nullptr;
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			c = &cells[pos & mask];
+			size_t const seq = c->seq.load(std::memory_order_acquire);
+			std::intptr_t const dif = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
+			if (0 == dif) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false; // empty or producer is still filling the cell
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+		consume(c->value);
+		c->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+	/// Only from consumer thread.
+	bool empty(void) const
+	{
+		size_t const pos = dequeue_pos.load(std::memory_order_relaxed);
+		cell const& c = cells[pos & mask];
+		return c.seq.load(std::memory_order_acquire) != pos + 1;
+	}
+	/// The next cell isn't consumed yet, so try_push would fail. From any thread, only approximate
+	/// while queue is used.
+	bool full(void) const
+	{
+		size_t const pos = enqueue_pos.load(std::memory_order_relaxed);
+		cell const& c = cells[pos & mask];
+		return (std::intptr_t)c.seq.load(std::memory_order_acquire) - (std::intptr_t)pos < 0;
+	}
+	/// Calls visit(_T const&) for values which are published and not consumed yet. Consumer may pop
+	/// at the same time, so it's only for best effort dump when process is crashing.
+	template<typename _Fn>
+	void peek(_Fn&& visit) const
+	{
+		size_t const end = enqueue_pos.load(std::memory_order_acquire);
+		for (size_t pos = dequeue_pos.load(std::memory_order_acquire); pos != end; ++pos) {
+			cell const& c = cells[pos & mask];
+			if (c.seq.load(std::memory_order_acquire) == pos + 1)
+				visit(c.value);
+		}
+	}
+	/// Cells reserved since start, from any thread. Values pushed before are consumed when dequeued() reaches it.
+	size_t enqueued(void) const
+	{
+		return enqueue_pos.load(std::memory_order_acquire);
+	}
+	/// Cells claimed by try_pop since start, those claimed by consumer are consumed when it's done with its pops.
+	size_t dequeued(void) const
+	{
+		return dequeue_pos.load(std::memory_order_acquire);
+	}
+	/// Reserved and not yet consumed cells, from any thread. Only approximate while queue is used.
+	size_t size_approx(void) const
+	{
+		size_t const deq = dequeue_pos.load(std::memory_order_relaxed);
+		size_t const enq = enqueue_pos.load(std::memory_order_relaxed);
+		return (std::intptr_t)(enq - deq) > 0 ? enq - deq : 0;
+	}
+private:
+	size_t const                       mask;
+	std::unique_ptr<cell[]>            cells;
+	alignas(64) std::atomic<size_t>    enqueue_pos;
+	alignas(64) std::atomic<size_t>    dequeue_pos;
+};
+
+}
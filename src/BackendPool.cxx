@@ -0,0 +1,188 @@
+#include "LoggerImpl.h"
+#include <algorithm>
+#include <cerrno>
+#ifdef _WIN32
+# include <Windows.h>
+#elif defined(__linux__)
+# include <sched.h>
+# include <sys/resource.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+namespace beam_me_up {
+
+/// Backend thread with settings it had when it entered, they are restored for empty policy
+struct BackendThread {
+	unsigned long id;
+#ifdef _WIN32
+	HANDLE        handle;
+	int           basepriority;
+#elif defined(__linux__)
+	cpu_set_t     baseaffinity;
+	int           basenice;
+#endif
+};
+
+static std::mutex                 backend_mutex;
+static std::vector<BackendThread> backend_threads;
+static std::vector<int>           backend_cpus;
+static int                        backend_priority = 0;
+
+static void applyPolicy(BackendThread const& t)
+{
+	int const priority = backend_priority < -2 ? -2 : backend_priority > 2 ? 2 : backend_priority;
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+	DWORD_PTR systemmask = 0;
+	GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemmask);
+	if (!backend_cpus.empty()) {
+		DWORD_PTR wanted = 0;
+		for (int cpu : backend_cpus) {
+			if (cpu >= 0 && cpu < (int)(8 * sizeof(DWORD_PTR)))
+				wanted |= DWORD_PTR(1) << cpu;
+		}
+		mask = wanted & mask ? wanted & mask : mask; // none of them is available, thread keeps process CPUs
+	}
+	SetThreadAffinityMask(t.handle, mask);
+	int const wanted = t.basepriority + priority;
+	SetThreadPriority(t.handle, wanted < THREAD_PRIORITY_LOWEST ? THREAD_PRIORITY_LOWEST : wanted > THREAD_PRIORITY_HIGHEST ? THREAD_PRIORITY_HIGHEST : wanted);
+#elif defined(__linux__)
+	cpu_set_t set = t.baseaffinity;
+	if (!backend_cpus.empty()) {
+		CPU_ZERO(&set);
+		for (int cpu : backend_cpus) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		}
+	}
+	if (0 != sched_setaffinity((pid_t)t.id, sizeof(set), &set))
+		sched_setaffinity((pid_t)t.id, sizeof(t.baseaffinity), &t.baseaffinity); // none of them is online
+	int const nice = t.basenice - 5 * priority; // Linux nice is per thread
+	setpriority(PRIO_PROCESS, (id_t)t.id, nice < -20 ? -20 : nice > 19 ? 19 : nice);
+#else
+	(void)t;
+	(void)priority;
+#endif
+}
+
+void BackendThreads::setPolicy(std::vector<int> const& cpus, int priority)
+{
+	std::lock_guard<std::mutex> lock(backend_mutex);
+	backend_cpus = cpus;
+	backend_priority = priority;
+	for (BackendThread const& t : backend_threads)
+		applyPolicy(t);
+}
+
+void BackendThreads::enter(void)
+{
+	BackendThread t;
+#ifdef _WIN32
+	t.id = GetCurrentThreadId();
+	t.handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION, FALSE, t.id);
+	t.basepriority = GetThreadPriority(GetCurrentThread());
+#elif defined(__linux__)
+	t.id = (unsigned long)syscall(SYS_gettid);
+	CPU_ZERO(&t.baseaffinity);
+	sched_getaffinity(0, sizeof(t.baseaffinity), &t.baseaffinity);
+	errno = 0;
+	t.basenice = getpriority(PRIO_PROCESS, (id_t)t.id);
+	if (errno)
+		t.basenice = 0;
+#else
+	t.id = 0;
+#endif
+	std::lock_guard<std::mutex> lock(backend_mutex);
+	if (!backend_cpus.empty() || backend_priority)
+		applyPolicy(t);
+	backend_threads.push_back(t);
+}
+
+void BackendThreads::leave(void)
+{
+#ifdef _WIN32
+	unsigned long const id = GetCurrentThreadId();
+#elif defined(__linux__)
+	unsigned long const id = (unsigned long)syscall(SYS_gettid);
+#else
+	unsigned long const id = 0;
+#endif
+	std::lock_guard<std::mutex> lock(backend_mutex);
+	auto it = std::find_if(backend_threads.begin(), backend_threads.end(), [id](BackendThread const& t) { return t.id == id; });
+	if (it == backend_threads.end())
+		return;
+#ifdef _WIN32
+	if (it->handle)
+		CloseHandle(it->handle);
+#endif
+	backend_threads.erase(it);
+}
+
+SinkPool::SinkPool(size_t count, size_t capacity)
+	: workers()
+	, finish(false)
+{
+	for (size_t i = 0; i < count; ++i)
+		workers.emplace_back(new worker(capacity));
+	for (std::unique_ptr<worker>& w : workers)
+		w->thread = thread_type(&SinkPool::run, this, std::ref(*w));
+}
+
+SinkPool::~SinkPool()
+{
+	finish = true;
+	for (std::unique_ptr<worker>& w : workers) {
+		w->lines_ready.notify_one();
+		w->thread.join();
+	}
+}
+
+void SinkPool::write(size_t index, LogSinkPtr const& sink, char const* line, size_t n, loglevel_e lvl)
+{
+	worker& w = *workers[index];
+	auto fill = [&](SinkLine& rec) { // reuses capacity of the cell
+		rec.line.assign(line, n);
+		rec.sink = sink;
+		rec.level = lvl;
+	};
+	while (!w.lines.try_push(fill)) { // full, worker has to make room
+		w.lines_ready.notify_one();
+		w.lines_room.wait([&] { return !w.lines.full(); });
+	}
+	w.lines_ready.notify_one();
+}
+
+void SinkPool::drain(void)
+{
+	for (std::unique_ptr<worker>& w : workers)
+		w->drained.wait(w->lines.enqueued(), [&] { w->lines_ready.notify_one(); });
+}
+
+void SinkPool::run(worker& w)
+{
+#ifndef NDEBUG
+	bmu::logmanip::setThreadName(L"##### SinkWorker thread #####");
+#endif
+	BackendThreadScope backend;
+	std::vector<LogSinkPtr> written; // flushed when queue is drained
+	auto write_line = [&](SinkLine& rec) {
+		rec.sink->write(rec.line.data(), rec.line.size(), rec.level);
+		if (written.end() == std::find(written.begin(), written.end(), rec.sink))
+			written.push_back(rec.sink);
+		rec.sink.reset(); // removed sink isn't kept alive by the cell
+	};
+	for (;;) {
+		w.lines_ready.wait([&] { return !w.lines.empty() || finish || w.drained.pending(); });
+		while (w.lines.try_pop(write_line))
+			w.lines_room.notify_all();
+		for (LogSinkPtr const& sink : written)
+			sink->flush();
+		written.clear();
+		w.drained.publish(w.lines.dequeued());
+		if (finish && w.lines.empty())
+			break;
+	}
+}
+
+}
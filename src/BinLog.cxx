@@ -0,0 +1,523 @@
+#include "LoggerImpl.h"
+#include "bmu/BinLog.h"
+#include "bmu/codepoint_transform.hxx"
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace beam_me_up {
+
+static char const binlog_magic[8] = { 'B', 'M', 'U', 'B', 'L', 'O', 'G', '2' };
+static char const binlog_magic_u16[8] = { 'B', 'M', 'U', 'B', 'L', 'O', 'G', '1' }; // u16 lengths in 'F' and 'K'
+static size_t const binlog_header_size = sizeof(std::uint32_t) + sizeof(std::uint64_t) + sizeof(std::uint32_t);
+
+static std::mutex               formats_mutex;
+static std::deque<BinlogFormat> formats; // deque keeps references valid on push_back
+
+template<typename _T>
+static bool readValue(char const*& it, char const* const end, _T& val)
+{
+	if (end - it < (std::ptrdiff_t)sizeof(val))
+		return false;
+	std::memcpy(&val, it, sizeof(val));
+	it += sizeof(val);
+	return true;
+}
+
+template<typename _T>
+static bool readValue(std::istream& in, _T& val)
+{
+	return !!in.read((char*)&val, sizeof(val));
+}
+
+/// Appends n octets to out which grows only by what was read, so length in corrupted entry can't
+/// allocate more than the rest of input
+static bool readOctets(std::istream& in, std::string& out, size_t n)
+{
+	size_t const chunk = 64 * 1024;
+	while (n) {
+		size_t const part = n < chunk ? n : chunk;
+		size_t const pos = out.size();
+		out.resize(pos + part);
+		if (!in.read(&out[pos], part))
+			return false;
+		n -= part;
+	}
+	return true;
+}
+
+/// Length of name in 'F' or 'K' entry
+static bool readLength(std::istream& in, bool u16, std::uint32_t& len)
+{
+	std::uint16_t len16 = 0;
+	if (!u16)
+		return readValue(in, len);
+	if (!readValue(in, len16))
+		return false;
+	len = len16;
+	return true;
+}
+
+template<typename _T>
+static void writeValue(std::streambuf& out, _T const& val)
+{
+	out.sputn((char const*)&val, sizeof(val));
+}
+
+static void appendNumber(std::string& out, char const* fmt, ...)
+{
+	char buf[64];
+	va_list args;
+	va_start(args, fmt);
+	int const cch = std::vsnprintf(buf, _countof(buf), fmt, args);
+	va_end(args);
+	if (cch > 0)
+		out.append(buf, cch);
+}
+
+static char const* level_name(loglevel_e lvl)
+{
+	switch (lvl)
+	{
+	case LERROR: return "error";
+	case LWARN: return "warn";
+	case LINFO: return "info";
+	case LTRACE: return "trace";
+	case LDUMP: return "dump";
+	}
+	return "info";
+}
+
+/// How argument is written, strings are quoted for logfmt and JSON
+enum argstyle_e { ARGSTYLE_TEXT, ARGSTYLE_LOGFMT, ARGSTYLE_JSON };
+
+static void appendQuoted(std::string& out, char const* s, size_t n, argstyle_e style)
+{
+	if (ARGSTYLE_TEXT == style) {
+		out.append(s, n);
+		return;
+	}
+	bool quote = ARGSTYLE_JSON == style || 0 == n;
+	for (size_t i = 0; i < n && !quote; ++i)
+		quote = ' ' == s[i] || '=' == s[i] || '"' == s[i] || '\\' == s[i] || (unsigned char)s[i] < 0x20;
+	if (!quote) {
+		out.append(s, n);
+		return;
+	}
+	out.push_back('"');
+	for (size_t i = 0; i < n; ++i) {
+		char const c = s[i];
+		if ('"' == c || '\\' == c) {
+			out.push_back('\\');
+			out.push_back(c);
+		}
+		else if ('\n' == c)
+			out.append("\\n");
+		else if ('\t' == c)
+			out.append("\\t");
+		else if ((unsigned char)c < 0x20)
+			appendNumber(out, "\\u%04x", (unsigned)c);
+		else
+			out.push_back(c);
+	}
+	out.push_back('"');
+}
+
+/// Formats one argument and moves it past the argument. False for malformed argument.
+static bool appendArg(std::string& out, char const*& it, char const* const end, argstyle_e style = ARGSTYLE_TEXT)
+{
+	std::uint8_t tag = 0;
+	if (!readValue(it, end, tag))
+		return false;
+	switch (tag)
+	{
+	case BINARG_INT: {
+		std::int64_t v = 0;
+		if (!readValue(it, end, v))
+			return false;
+		appendNumber(out, "%lld", (long long)v);
+		return true;
+	}
+	case BINARG_UINT: {
+		std::uint64_t v = 0;
+		if (!readValue(it, end, v))
+			return false;
+		appendNumber(out, "%llu", (unsigned long long)v);
+		return true;
+	}
+	case BINARG_DOUBLE: {
+		double v = 0;
+		if (!readValue(it, end, v))
+			return false;
+		if (ARGSTYLE_JSON == style && !(v - v == 0)) // JSON has no inf and nan
+			out.append("null");
+		else
+			appendNumber(out, "%g", v); // same as default std::ostream precision
+		return true;
+	}
+	case BINARG_CHAR: {
+		std::uint32_t cp = 0;
+		if (!readValue(it, end, cp))
+			return false;
+		char octets[8];
+		size_t len = putUTF8Octets(cp, octets, sizeof(octets));
+		if (0 == len)
+			len = putUTF8Octets(0xfffdu, octets, sizeof(octets));
+		appendQuoted(out, octets, len, style);
+		return true;
+	}
+	case BINARG_STR: {
+		std::uint32_t len = 0;
+		if (!readValue(it, end, len) || end - it < (std::ptrdiff_t)len)
+			return false;
+		appendQuoted(out, it, len, style);
+		it += len;
+		return true;
+	}
+	case BINARG_PTR: {
+		std::uint64_t v = 0;
+		if (!readValue(it, end, v))
+			return false;
+		appendNumber(out, ARGSTYLE_JSON == style ? "\"0x%llx\"" : "0x%llx", (unsigned long long)v);
+		return true;
+	}
+	case BINARG_BOOL: {
+		std::uint8_t v = 0;
+		if (!readValue(it, end, v))
+			return false;
+		out.append(v ? "true" : "false");
+		return true;
+	}
+	}
+	return false;
+}
+
+std::uint32_t registerBinlogFormat(loglevel_e lvl, char const* format, char const* file, unsigned int line)
+{
+	std::lock_guard<std::mutex> lock(formats_mutex);
+	std::uint32_t const id = (std::uint32_t)formats.size();
+	formats.push_back(BinlogFormat{ id, lvl, line, file ? file : "", format ? format : "", std::vector<std::string>() });
+	return id;
+}
+
+std::uint32_t registerStructuredFormat(loglevel_e lvl, char const* message, char const* file, unsigned int line, char const* const* keys, size_t nkeys)
+{
+	std::lock_guard<std::mutex> lock(formats_mutex);
+	std::uint32_t const id = (std::uint32_t)formats.size();
+	formats.push_back(BinlogFormat{ id, lvl, line, file ? file : "", message ? message : "", std::vector<std::string>(keys, keys + nkeys) });
+	return id;
+}
+
+BinlogFormat const* findBinlogFormat(std::uint32_t id)
+{
+	std::lock_guard<std::mutex> lock(formats_mutex);
+	return id < formats.size() ? &formats[id] : nullptr;
+}
+
+BinlogEncoder& BinlogEncoder::forThread(void)
+{
+	thread_local BinlogEncoder enc;
+	return enc;
+}
+
+void BinlogEncoder::begin(std::uint32_t id, loglevel_e lvl)
+{
+	level = lvl;
+	std::uint64_t const now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::uint32_t const arglen = 0; // patched in submit
+	buf.clear();
+	buf.append((char const*)&id, sizeof(id));
+	buf.append((char const*)&now, sizeof(now));
+	buf.append((char const*)&arglen, sizeof(arglen));
+}
+
+void BinlogEncoder::submit(void)
+{
+	assert(buf.size() >= binlog_header_size);
+	std::uint32_t const arglen = (std::uint32_t)(buf.size() - binlog_header_size);
+	std::memcpy(&buf[binlog_header_size - sizeof(arglen)], &arglen, sizeof(arglen));
+	TargetReaders::Scope reading; // writer isn't destroyed until it's pushed
+	if (QueueWriter* writer = LogsFactoryImpl::binlog_target.load(std::memory_order_seq_cst))
+		writer->writeBinary(buf.data(), buf.size(), level);
+}
+
+void BinlogEncoder::putThread(void)
+{
+	thread_local std::uint64_t const id = [] { // the same number as written by logmod_threadid
+		std::ostringstream oss;
+		oss << std::this_thread::get_id();
+		return (std::uint64_t)std::strtoull(oss.str().c_str(), nullptr, 10);
+	}();
+	put(id);
+	put(logmanip::getThreadName());
+}
+
+void BinlogEncoder::put(char const* s)
+{
+	if (!s)
+		s = "(null)";
+	putString(s, std::char_traits<char>::length(s));
+}
+
+void BinlogEncoder::put(wchar_t const* s)
+{
+	if (!s)
+		s = L"(null)";
+	putString(s, std::char_traits<wchar_t>::length(s));
+}
+
+void BinlogEncoder::putString(char const* s, size_t n)
+{
+	std::uint32_t const len = (std::uint32_t)n;
+	buf.push_back((char)BINARG_STR);
+	buf.append((char const*)&len, sizeof(len));
+	buf.append(s, n);
+}
+
+void BinlogEncoder::putString(wchar_t const* s, size_t n)
+{
+	std::uint32_t len = 0;
+	buf.push_back((char)BINARG_STR);
+	size_t const lenpos = buf.size();
+	buf.append((char const*)&len, sizeof(len));
+	appendWideAsUTF8(buf, s, n);
+	len = (std::uint32_t)(buf.size() - lenpos - sizeof(len));
+	std::memcpy(&buf[lenpos], &len, sizeof(len));
+}
+
+/// Structured record as logfmt or JSON line, it..end are arguments
+static bool formatStructured(BinlogFormat const& fmt, std::uint64_t nanosecs, char const* it, char const* const end, std::string& out, structformat_e style)
+{
+	argstyle_e const argstyle = STRUCTFORMAT_JSON == style ? ARGSTYLE_JSON : ARGSTYLE_LOGFMT;
+	char const* const sep = STRUCTFORMAT_JSON == style ? "," : " ";
+	auto key = [&](char const* k, size_t n) {
+		if (STRUCTFORMAT_JSON == style) {
+			appendQuoted(out, k, n, ARGSTYLE_JSON);
+			out.push_back(':');
+		}
+		else {
+			out.append(k, n);
+			out.push_back('=');
+		}
+	};
+	std::time_t const secs = (std::time_t)(nanosecs / 1000000000u);
+	std::tm local_tm;
+	to_localtime_thread_safe(secs, local_tm);
+	char buf[64];
+	size_t cch = std::strftime(buf, _countof(buf), "%Y-%m-%dT%H:%M:%S", &local_tm);
+	cch += std::snprintf(buf + cch, _countof(buf) - cch, ".%06u", (unsigned)(nanosecs / 1000u % 1000000u));
+	if (STRUCTFORMAT_JSON == style)
+		out.push_back('{');
+	key("time", 4);
+	appendQuoted(out, buf, cch, argstyle);
+	out.append(sep);
+	key("level", 5);
+	char const* const lvl = level_name(fmt.level);
+	appendQuoted(out, lvl, std::strlen(lvl), argstyle);
+	out.append(sep);
+	key("msg", 3);
+	appendQuoted(out, fmt.format.data(), fmt.format.size(), argstyle);
+	static char const* const threadkeys[] = { "thread", "threadname" };
+	for (char const* k : threadkeys) {
+		size_t const mark = out.size();
+		out.append(sep);
+		key(k, std::strlen(k));
+		size_t const valuepos = out.size();
+		if (it == end || !appendArg(out, it, end, argstyle))
+			return false;
+		if (k == threadkeys[1] && out.size() - valuepos == 2) // "" of empty name isn't written
+			out.resize(mark);
+	}
+	for (std::string const& k : fmt.keys) {
+		out.append(sep);
+		key(k.data(), k.size());
+		if (it == end || !appendArg(out, it, end, argstyle))
+			out.append("null"); // missing field
+	}
+	if (STRUCTFORMAT_JSON == style)
+		out.push_back('}');
+	out.push_back('\n');
+	return true;
+}
+
+bool formatBinlogRecord(BinlogFormat const& fmt, char const* rec, size_t n, std::string& out, structformat_e style)
+{
+	char const* it = rec;
+	char const* end = rec + n;
+	std::uint32_t id = 0;
+	std::uint64_t nanosecs = 0;
+	std::uint32_t arglen = 0;
+	if (!readValue(it, end, id) || !readValue(it, end, nanosecs) || !readValue(it, end, arglen))
+		return false;
+	if (end - it < (std::ptrdiff_t)arglen)
+		return false;
+	end = it + arglen;
+	if (!fmt.keys.empty())
+		return formatStructured(fmt, nanosecs, it, end, out, style);
+	{
+		std::time_t const secs = (std::time_t)(nanosecs / 1000000000u);
+		std::tm local_tm;
+		to_localtime_thread_safe(secs, local_tm);
+		char buf[64];
+		size_t cch = std::strftime(buf, _countof(buf), "%y%m%d-%H%M%S", &local_tm);
+		out.append(buf, cch);
+		appendNumber(out, ".%06u ", (unsigned)(nanosecs / 1000u % 1000000u));
+	}
+	out.append(to_string(fmt.level));
+	char const* f = fmt.format.data();
+	char const* const fend = f + fmt.format.size();
+	while (f != fend) {
+		char const* lit = f;
+		while (f != fend && *f != '{' && *f != '}')
+			++f;
+		out.append(lit, f - lit);
+		if (f == fend)
+			break;
+		if (fend - f > 1 && f[0] == f[1]) { // {{ or }}
+			out.push_back(*f);
+			f += 2;
+		}
+		else if (fend - f > 1 && '{' == f[0] && '}' == f[1]) {
+			if (it == end || !appendArg(out, it, end))
+				out.append("{}"); // missing argument
+			f += 2;
+		}
+		else {
+			out.push_back(*f);
+			++f;
+		}
+	}
+	out.push_back('\n');
+	return true;
+}
+
+void writeBinlogHeader(std::streambuf& out)
+{
+	out.sputn(binlog_magic, sizeof(binlog_magic));
+}
+
+void writeBinlogEntry(std::streambuf& out, std::vector<bool>& defined, char const* rec, size_t n)
+{
+	std::uint32_t id = 0;
+	if (n < binlog_header_size)
+		return;
+	std::memcpy(&id, rec, sizeof(id));
+	if (defined.size() <= id)
+		defined.resize(id + 1, false);
+	if (!defined[id]) {
+		BinlogFormat const* fmt = findBinlogFormat(id);
+		if (!fmt)
+			return;
+		out.sputc('F');
+		writeValue(out, fmt->id);
+		writeValue(out, (std::uint8_t)fmt->level);
+		writeValue(out, (std::uint32_t)fmt->line);
+		writeValue(out, (std::uint32_t)fmt->file.size());
+		out.sputn(fmt->file.data(), fmt->file.size());
+		writeValue(out, (std::uint32_t)fmt->format.size());
+		out.sputn(fmt->format.data(), fmt->format.size());
+		if (!fmt->keys.empty()) {
+			out.sputc('K');
+			writeValue(out, fmt->id);
+			writeValue(out, (std::uint32_t)fmt->keys.size());
+			for (std::string const& key : fmt->keys) {
+				writeValue(out, (std::uint32_t)key.size());
+				out.sputn(key.data(), key.size());
+			}
+		}
+		defined[id] = true;
+	}
+	out.sputc('R');
+	out.sputn(rec, n);
+}
+
+long long decodeBinlog(std::istream& in, std::ostream& out, structformat_e style)
+{
+	char magic[sizeof(binlog_magic)];
+	if (!in.read(magic, sizeof(magic)))
+		return -1;
+	bool const u16 = 0 == std::memcmp(magic, binlog_magic_u16, sizeof(magic));
+	if (!u16 && 0 != std::memcmp(magic, binlog_magic, sizeof(magic)))
+		return -1;
+	std::unordered_map<std::uint32_t, BinlogFormat> fileformats; // ids from file aren't used as sizes
+	std::string               rec;
+	std::string               text;
+	long long                 count = 0;
+	bool                      complete = false;
+	char                      kind = 0;
+	for (;;) {
+		if (!in.get(kind)) {
+			complete = in.eof(); // at the end of entry
+			break;
+		}
+		if ('F' == kind) {
+			BinlogFormat fmt;
+			std::uint8_t level = 0;
+			std::uint32_t line = 0;
+			std::uint32_t len = 0;
+			if (!readValue(in, fmt.id) || !readValue(in, level) || !readValue(in, line) || !readLength(in, u16, len))
+				break;
+			if (level > LDUMP) { // to_string knows only levels of loglevel_e
+				in.setstate(std::ios::failbit);
+				break;
+			}
+			fmt.level = (loglevel_e)level;
+			fmt.line = line;
+			if (!readOctets(in, fmt.file, len) || !readLength(in, u16, len) || !readOctets(in, fmt.format, len))
+				break;
+			fileformats[fmt.id] = std::move(fmt);
+		}
+		else if ('K' == kind) {
+			std::uint32_t id = 0;
+			std::uint32_t keycount = 0;
+			if (!readValue(in, id) || !readLength(in, u16, keycount))
+				break;
+			std::vector<std::string> keys;
+			std::uint32_t len = 0;
+			while (keys.size() < keycount && readLength(in, u16, len)) {
+				keys.emplace_back();
+				if (!readOctets(in, keys.back(), len))
+					break;
+			}
+			if (!in)
+				break;
+			fileformats[id].keys = std::move(keys);
+		}
+		else if ('R' == kind) {
+			rec.clear();
+			if (!readOctets(in, rec, binlog_header_size))
+				break;
+			std::uint32_t id = 0;
+			std::uint32_t arglen = 0;
+			std::memcpy(&id, &rec[0], sizeof(id));
+			std::memcpy(&arglen, &rec[binlog_header_size - sizeof(arglen)], sizeof(arglen));
+			if (!readOctets(in, rec, arglen))
+				break;
+			auto const fmt = fileformats.find(id);
+			if (fileformats.end() == fmt)
+				continue; // record without format descriptor
+			text.clear();
+			if (formatBinlogRecord(fmt->second, rec.data(), rec.size(), text, style)) {
+				out.write(text.data(), text.size());
+				++count;
+			}
+		}
+		else
+			break;
+	}
+	out.flush();
+	if (!complete)
+		in.setstate(std::ios::badbit); // truncated or corrupted entry, records before it are written
+	return count;
+}
+
+}
@@ -0,0 +1,240 @@
+#include "LoggerImpl.h"
+#include "bmu/codepoint_transform.hxx"
+#include "bmu/LogIndex.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#ifdef _WIN32
+# include <io.h>
+# include <share.h>
+# include <sys/stat.h>
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
+
+namespace beam_me_up {
+
+bool writeAll(int fd, char const* s, size_t n)
+{
+	while (n) {
+#ifdef _WIN32
+		int const w = _write(fd, s, (unsigned int)(n < 0x40000000u ? n : 0x40000000u));
+#else
+		ssize_t const w = ::write(fd, s, n);
+#endif
+		if (w < 0) {
+			if (EINTR == errno)
+				continue;
+			return false;
+		}
+		s += w;
+		n -= (size_t)w;
+	}
+	return true;
+}
+
+static int createFile(std::wstring const& filename)
+{
+	int fd = -1;
+#ifdef _WIN32
+	_wsopen_s(&fd, filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+#else
+	std::string utf8name;
+	appendWideAsUTF8(utf8name, filename.data(), filename.size());
+	do {
+		fd = ::open(utf8name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	} while (fd < 0 && EINTR == errno);
+#endif
+	return fd;
+}
+
+static void closeFile(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	::close(fd);
+#endif
+}
+
+static void removeFile(std::wstring const& filename)
+{
+#ifdef _WIN32
+	_wremove(filename.c_str());
+#else
+	std::string utf8name;
+	appendWideAsUTF8(utf8name, filename.data(), filename.size());
+	::unlink(utf8name.c_str());
+#endif
+}
+
+FileSinkBuf::FileSinkBuf(FileBatching const& batching)
+	: fd(-1)
+	, buf(batching.maxbytes ? batching.maxbytes : 1)
+	, maxdelay(batching.maxdelayms)
+	, first()
+	, datasync(batching.datasync)
+	, unsynced(false)
+	, idxfd(-1)
+	, indexrecords(batching.indexrecords)
+	, indexbytes(batching.indexbytes)
+	, offset(0)
+	, indexedoffset(0)
+	, indexedrecords(0)
+	, indexedns(-1)
+{
+	setp(buf.data(), buf.data() + buf.size());
+}
+
+FileSinkBuf::~FileSinkBuf()
+{
+	if (fd < 0)
+		return;
+	if (idxfd >= 0 && indexedns >= 0)
+		addIndexEntry(); // end of the last range
+	flushBatch(nullptr, 0);
+	if (DATASYNC_NONE != datasync)
+		dataSync();
+	closeFile(fd);
+	if (idxfd >= 0)
+		closeFile(idxfd);
+}
+
+bool FileSinkBuf::open(std::wstring const& filename)
+{
+	if (fd >= 0)
+		return false;
+	fd = createFile(filename);
+	this->filename = filename;
+	if (fd >= 0 && (indexrecords || indexbytes)) {
+		idxfd = createFile(filename + L".idx");
+		if (idxfd >= 0 && !writeAll(idxfd, logindex_magic, sizeof(logindex_magic))) {
+			closeFile(idxfd);
+			idxfd = -1;
+		}
+	}
+	return fd >= 0;
+}
+
+void FileSinkBuf::removeIfUnused(void)
+{
+	if (fd < 0 || offset)
+		return;
+	closeFile(fd);
+	fd = -1;
+	removeFile(filename);
+	if (idxfd >= 0) {
+		closeFile(idxfd);
+		idxfd = -1;
+		removeFile(filename + L".idx");
+	}
+}
+
+void FileSinkBuf::dataSync(void)
+{
+#ifdef _WIN32
+	_commit(fd);
+#elif defined(__APPLE__)
+	::fsync(fd); // there is no fdatasync
+#else
+	::fdatasync(fd);
+#endif
+	unsynced = false;
+}
+
+bool FileSinkBuf::flushBatch(char const* extra, size_t extralen)
+{
+	size_t const buffered = pptr() - pbase();
+	bool ok = true;
+	if (buffered || extralen) {
+#ifdef _WIN32
+		ok = writeAll(fd, pbase(), buffered) && writeAll(fd, extra, extralen);
+#else
+		if (!extralen)
+			ok = writeAll(fd, pbase(), buffered);
+		else { // buffered lines and the line that doesn't fit with one system call
+			iovec iov[2] = { { pbase(), buffered }, { const_cast<char*>(extra), extralen } };
+			ssize_t w = 0;
+			do {
+				w = ::writev(fd, iov, 2);
+			} while (w < 0 && EINTR == errno);
+			ok = w >= 0;
+			if (ok && (size_t)w < buffered + extralen) { // partial write, rest one by one
+				size_t const done = (size_t)w;
+				ok = done < buffered
+					? writeAll(fd, pbase() + done, buffered - done) && writeAll(fd, extra, extralen)
+					: writeAll(fd, extra + (done - buffered), extralen - (done - buffered));
+			}
+		}
+#endif
+		unsynced = true;
+	}
+	setp(buf.data(), buf.data() + buf.size());
+	if (unsynced && DATASYNC_BATCH == datasync)
+		dataSync();
+	if (!idxpending.empty()) { // after lines, so entries never point past the written file
+		writeAll(idxfd, idxpending.data(), idxpending.size());
+		idxpending.clear();
+	}
+	return ok;
+}
+
+void FileSinkBuf::addIndexEntry(void)
+{
+	long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	if (ns < indexedns)
+		ns = indexedns; // entries stay sorted when clock is set back
+	std::uint64_t const entry[2] = { (std::uint64_t)ns, offset };
+	idxpending.append((char const*)entry, sizeof(entry));
+	indexedns = ns;
+	indexedoffset = offset;
+	indexedrecords = 0;
+}
+
+std::streamsize FileSinkBuf::xsputn(char const* s, std::streamsize n)
+{
+	if (fd < 0)
+		return 0;
+	if (pptr() == pbase())
+		first = std::chrono::steady_clock::now();
+	else if (maxdelay.count() && std::chrono::steady_clock::now() - first >= maxdelay) {
+		flushBatch(nullptr, 0); // backend is busy for long, don't keep old lines
+		first = std::chrono::steady_clock::now();
+	}
+	if (idxfd >= 0) { // backend writes every record with one call
+		if (indexedns < 0 || (indexrecords && indexedrecords >= indexrecords) || (indexbytes && offset - indexedoffset >= indexbytes))
+			addIndexEntry();
+		++indexedrecords;
+	}
+	offset += (unsigned long long)n;
+	if (epptr() - pptr() >= n) {
+		traits_type::copy(pptr(), s, (size_t)n);
+		pbump((int)n);
+		return n;
+	}
+	return flushBatch(s, (size_t)n) ? n : 0;
+}
+
+FileSinkBuf::int_type FileSinkBuf::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+	char const ch = traits_type::to_char_type(c);
+	return 1 == xsputn(&ch, 1) ? c : traits_type::eof();
+}
+
+int FileSinkBuf::sync(void)
+{
+	if (fd < 0)
+		return -1;
+	bool const ok = flushBatch(nullptr, 0);
+	if (unsynced && DATASYNC_IDLE == datasync)
+		dataSync();
+	return ok ? 0 : -1;
+}
+
+}
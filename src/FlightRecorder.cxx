@@ -0,0 +1,321 @@
+#include "LoggerImpl.h"
+#include "bmu/FlightRecorder.h"
+#include "bmu/codepoint_transform.hxx"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#ifdef _WIN32
+# include <io.h>
+# include <share.h>
+# include <sys/stat.h>
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+namespace beam_me_up {
+
+/// Ring of one thread. Rings are never freed so signal handler can read any of them without
+/// locking, ring of finished thread is taken by the next new thread.
+struct FlightRing {
+	std::atomic<bool>   owned;
+	std::atomic<size_t> written; // total octets, position is written % size
+	unsigned int        thread; // number of the thread which uses it
+	size_t              size;
+	char*               buf;
+};
+
+static size_t const max_rings = 256;
+static size_t const max_writers = 16;
+static std::atomic<FlightRing*>         rings[max_rings];
+static std::atomic<QueueWriter const*>  writers[max_writers];
+static std::atomic<unsigned int>        thread_count(0);
+static int const fatal_signals[] = {
+	SIGSEGV, SIGABRT, SIGFPE, SIGILL,
+#ifdef SIGBUS
+	SIGBUS,
+#endif
+};
+#ifdef _WIN32
+typedef wchar_t         path_char;
+typedef void (*SignalHandlerFn)(int);
+static SignalHandlerFn  previous[_countof(fatal_signals)];
+static path_char        crash_path[1024];
+#else
+typedef char            path_char;
+static struct sigaction previous[_countof(fatal_signals)];
+static path_char        crash_path[4096];
+#endif
+static bool             handlers_installed = false;
+
+std::atomic<size_t> FlightRecorder::ringbytes(0);
+
+/// Gives the ring back when thread ends
+struct FlightRingHolder {
+	FlightRing* ring = nullptr;
+	bool        tried = false;
+	~FlightRingHolder()
+	{
+		if (ring)
+			ring->owned.store(false, std::memory_order_release);
+	}
+};
+
+/// Ring of this thread, the first call takes free ring or allocates new one. Null if there are too many threads.
+static FlightRing* ringForThread(size_t bytes)
+{
+	thread_local FlightRingHolder holder;
+	if (holder.ring || holder.tried)
+		return holder.ring;
+	holder.tried = true;
+	for (std::atomic<FlightRing*>& slot : rings) {
+		FlightRing* ring = slot.load(std::memory_order_acquire);
+		bool expected = false;
+		if (ring && ring->size == bytes && ring->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+			ring->written.store(0, std::memory_order_release);
+			ring->thread = ++thread_count;
+			return holder.ring = ring;
+		}
+	}
+	FlightRing* ring = new FlightRing;
+	ring->owned.store(true, std::memory_order_relaxed);
+	ring->written.store(0, std::memory_order_relaxed);
+	ring->thread = ++thread_count;
+	ring->size = bytes;
+	ring->buf = new char[bytes];
+	for (std::atomic<FlightRing*>& slot : rings) {
+		FlightRing* expected = nullptr;
+		if (slot.compare_exchange_strong(expected, ring, std::memory_order_acq_rel))
+			return holder.ring = ring;
+	}
+	delete[] ring->buf;
+	delete ring;
+	return nullptr;
+}
+
+void FlightRecorder::record(char const* s, size_t n)
+{
+	size_t const bytes = ringbytes.load(std::memory_order_relaxed);
+	FlightRing* ring = bytes ? ringForThread(bytes) : nullptr;
+	if (!ring || !n)
+		return;
+	if (n > ring->size) { // only the end of too long line
+		s += n - ring->size;
+		n = ring->size;
+	}
+	size_t const written = ring->written.load(std::memory_order_relaxed);
+	size_t const pos = written % ring->size;
+	size_t const first = n < ring->size - pos ? n : ring->size - pos;
+	std::memcpy(ring->buf + pos, s, first);
+	std::memcpy(ring->buf, s + first, n - first);
+	ring->written.store(written + n, std::memory_order_release);
+}
+
+void FlightRecorder::record(wchar_t const* s, size_t n)
+{
+	thread_local std::string utf8;
+	utf8.clear();
+	appendWideAsUTF8(utf8, s, n);
+	record(utf8.data(), utf8.size());
+}
+
+void FlightRecorder::addWriter(QueueWriter const* writer)
+{
+	for (std::atomic<QueueWriter const*>& slot : writers) {
+		QueueWriter const* expected = nullptr;
+		if (slot.compare_exchange_strong(expected, writer, std::memory_order_acq_rel))
+			return;
+	}
+}
+
+void FlightRecorder::removeWriter(QueueWriter const* writer)
+{
+	for (std::atomic<QueueWriter const*>& slot : writers) {
+		QueueWriter const* expected = writer;
+		if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+			return;
+	}
+}
+
+static void writeText(int fd, char const* s)
+{
+	writeAll(fd, s, std::strlen(s));
+}
+
+static void writeNumber(int fd, unsigned long long v)
+{
+	char buf[24];
+	char* p = buf + sizeof(buf);
+	do {
+		*--p = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	writeAll(fd, p, buf + sizeof(buf) - p);
+}
+
+void FlightRecorder::dump(int fd, int sig)
+{
+	writeText(fd, "**** flight recorder, signal ");
+	writeNumber(fd, (unsigned long long)sig);
+	writeText(fd, " ****\n");
+	for (std::atomic<FlightRing*>& slot : rings) {
+		FlightRing const* ring = slot.load(std::memory_order_acquire);
+		size_t const written = ring ? ring->written.load(std::memory_order_acquire) : 0;
+		if (!written)
+			continue;
+		writeText(fd, "---- thread ");
+		writeNumber(fd, ring->thread);
+		writeText(fd, ring->owned.load(std::memory_order_relaxed) ? " ----\n" : " finished ----\n");
+		if (written <= ring->size) {
+			writeAll(fd, ring->buf, written);
+			continue;
+		}
+		size_t start = written % ring->size; // the oldest octet, its line is incomplete
+		size_t len = ring->size;
+		while (len && '\n' != ring->buf[start]) {
+			start = (start + 1) % ring->size;
+			--len;
+		}
+		if (len) { // past the end of incomplete line
+			start = (start + 1) % ring->size;
+			--len;
+		}
+		size_t const first = len < ring->size - start ? len : ring->size - start;
+		writeAll(fd, ring->buf + start, first);
+		writeAll(fd, ring->buf, len - first);
+	}
+	writeText(fd, "---- not written yet ----\n");
+	for (std::atomic<QueueWriter const*>& slot : writers) {
+		if (QueueWriter const* writer = slot.load(std::memory_order_acquire)) {
+			writer->forEachPending([fd](LogRecord const& rec) {
+				if (!rec.text.empty())
+					writeAll(fd, rec.text.data(), rec.text.size());
+			});
+		}
+	}
+}
+
+/// Opens file for dump with async-signal-safe calls, -1 on error
+static int openDumpFile(path_char const* path)
+{
+	int fd = -1;
+#ifdef _WIN32
+	_wsopen_s(&fd, path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+#else
+	do {
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	} while (fd < 0 && EINTR == errno);
+#endif
+	return fd;
+}
+
+static void closeDumpFile(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	::close(fd);
+#endif
+}
+
+void FlightRecorder::onFatalSignal(int sig)
+{
+	int const saved_errno = errno;
+	int const fd = openDumpFile(crash_path);
+	if (fd >= 0) {
+		dump(fd, sig);
+		closeDumpFile(fd);
+	}
+	for (size_t i = 0; i < _countof(fatal_signals); ++i) {
+		if (fatal_signals[i] != sig)
+			continue;
+#ifdef _WIN32
+		signal(sig, previous[i] ? previous[i] : SIG_DFL);
+#else
+		sigaction(sig, &previous[i], nullptr);
+#endif
+	}
+	errno = saved_errno;
+	raise(sig); // previous handler gets the signal when this one returns
+}
+
+bool FlightRecorder::install(std::wstring const& crashfile, loglevel_e level, size_t bytes)
+{
+	if (crashfile.empty() || !bytes)
+		return false;
+#ifdef _WIN32
+	if (crashfile.size() >= _countof(crash_path))
+		return false;
+	std::memcpy(crash_path, crashfile.c_str(), (crashfile.size() + 1) * sizeof(wchar_t));
+#else
+	std::string utf8name;
+	appendWideAsUTF8(utf8name, crashfile.data(), crashfile.size());
+	if (utf8name.size() >= _countof(crash_path))
+		return false;
+	std::memcpy(crash_path, utf8name.c_str(), utf8name.size() + 1);
+#endif
+	ringbytes.store(bytes, std::memory_order_relaxed);
+	logmanip::setRecorderLevel(level);
+	if (handlers_installed)
+		return true;
+	for (size_t i = 0; i < _countof(fatal_signals); ++i) {
+#ifdef _WIN32
+		previous[i] = signal(fatal_signals[i], &FlightRecorder::onFatalSignal);
+#else
+		struct sigaction sa;
+		std::memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = &FlightRecorder::onFatalSignal;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_ONSTACK; // uses alternate stack if the thread has one, e.g. for stack overflow
+		sigaction(fatal_signals[i], &sa, &previous[i]);
+#endif
+	}
+	handlers_installed = true;
+	return true;
+}
+
+void FlightRecorder::uninstall(void)
+{
+	logmanip::setRecorderLevel(-1);
+	ringbytes.store(0, std::memory_order_relaxed);
+	if (!handlers_installed)
+		return;
+	for (size_t i = 0; i < _countof(fatal_signals); ++i) {
+#ifdef _WIN32
+		signal(fatal_signals[i], previous[i] ? previous[i] : SIG_DFL);
+#else
+		sigaction(fatal_signals[i], &previous[i], nullptr);
+#endif
+	}
+	handlers_installed = false;
+}
+
+bool installFlightRecorder(std::wstring const& crashfile, loglevel_e level, size_t ringbytes)
+{
+	return FlightRecorder::install(crashfile, level, ringbytes);
+}
+
+void uninstallFlightRecorder(void)
+{
+	FlightRecorder::uninstall();
+}
+
+bool dumpFlightRecorder(std::wstring const& filename)
+{
+#ifdef _WIN32
+	int const fd = openDumpFile(filename.c_str());
+#else
+	std::string utf8name;
+	appendWideAsUTF8(utf8name, filename.data(), filename.size());
+	int const fd = openDumpFile(utf8name.c_str());
+#endif
+	if (fd < 0)
+		return false;
+	FlightRecorder::dump(fd, 0);
+	closeDumpFile(fd);
+	return true;
+}
+
+}
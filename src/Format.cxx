@@ -0,0 +1,144 @@
+#include "LoggerImpl.h"
+#include "bmu/Format.h"
+#include "bmu/codepoint_transform.hxx"
+#include <cstdio>
+#include <cstring>
+#if __cplusplus >= 201703L && defined(__has_include)
+# if __has_include(<charconv>)
+#  include <charconv>
+# endif
+#endif
+
+namespace beam_me_up {
+
+FormatRecord& FormatRecord::forThread(void)
+{
+	thread_local FormatRecord rec;
+	return rec;
+}
+
+void FormatRecord::begin(loglevel_e lvl)
+{
+	level = lvl;
+	text.clear();
+	text.append(to_string(lvl));
+}
+
+void FormatRecord::submit(void)
+{
+	text.push_back('\n');
+	if (FlightRecorder::recording())
+		FlightRecorder::record(text.data(), text.size());
+	if (!logmanip::isOutput(level))
+		return;
+	{
+		TargetReaders::Scope reading; // writer isn't destroyed until the line is written
+		if (QueueWriter* writer = LogsFactoryImpl::clog_target.load(std::memory_order_seq_cst)) {
+			logmanip::line_level = level; // for overflow policy of the writer
+			writer->write(text.data(), (std::streamsize)text.size());
+			logmanip::endLine();
+			return;
+		}
+	}
+	std::clog.write(text.data(), (std::streamsize)text.size()); // there is no LogsFactory instance
+}
+
+char const* FormatRecord::literal(char const* f)
+{
+	for (;;) {
+		char const* lit = f;
+		while (*f && '{' != *f && '}' != *f)
+			++f;
+		text.append(lit, f - lit);
+		if (!*f)
+			return f;
+		if ('{' == f[0] && '}' == f[1])
+			return f + 2;
+		text.push_back(*f); // {{ and }} are one brace, single brace is rejected by LVLFLOG and only copied here
+		f += f[0] == f[1] ? 2 : 1;
+	}
+}
+
+void FormatRecord::put(char v)
+{
+	if ((unsigned char)v < 0x80)
+		text.push_back(v);
+	else
+		putUTF8Octets((unsigned char)v, std::back_inserter(text));
+}
+
+void FormatRecord::put(wchar_t v)
+{
+	appendWideAsUTF8(text, &v, 1);
+}
+
+void FormatRecord::put(void const* v)
+{
+	char buf[32];
+	int const cch = std::snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)(std::uintptr_t)v);
+	if (cch > 0)
+		text.append(buf, cch);
+}
+
+void FormatRecord::put(wchar_t const* s)
+{
+	if (!s)
+		text.append("(null)");
+	else
+		appendWideAsUTF8(text, s, std::wcslen(s));
+}
+
+void FormatRecord::put(std::wstring const& s)
+{
+	appendWideAsUTF8(text, s.data(), s.size());
+}
+
+void FormatRecord::putSigned(long long v)
+{
+	if (v < 0) {
+		text.push_back('-');
+		putUnsigned(0 - (unsigned long long)v);
+	}
+	else
+		putUnsigned((unsigned long long)v);
+}
+
+void FormatRecord::putUnsigned(unsigned long long v)
+{
+	static char const pairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	char buf[24];
+	char* p = buf + sizeof(buf);
+	while (v >= 100) { // two digits at once
+		unsigned const i = (unsigned)(v % 100) * 2;
+		v /= 100;
+		*--p = pairs[i + 1];
+		*--p = pairs[i];
+	}
+	if (v >= 10) {
+		*--p = pairs[v * 2 + 1];
+		*--p = pairs[v * 2];
+	}
+	else
+		*--p = (char)('0' + v);
+	text.append(p, buf + sizeof(buf) - p);
+}
+
+void FormatRecord::putDouble(double v)
+{
+	char buf[64];
+#ifdef __cpp_lib_to_chars
+	std::to_chars_result const res = std::to_chars(buf, buf + sizeof(buf), v, std::chars_format::general, 6);
+	if (std::errc() == res.ec) {
+		text.append(buf, res.ptr - buf);
+		return;
+	}
+#endif
+	int const cch = std::snprintf(buf, sizeof(buf), "%g", v); // same as default std::ostream precision
+	if (cch > 0)
+		text.append(buf, cch);
+}
+
+}
@@ -0,0 +1,158 @@
+#include "bmu/LogIndex.h"
+#include "bmu/codepoint_transform.hxx"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#ifdef _WIN32
+# define WIN32_LEAN_AND_MEAN
+# define NOMINMAX
+# include <windows.h>
+# include <sys/stat.h>
+#else
+# include <cerrno>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+namespace beam_me_up {
+
+#ifndef _WIN32
+static std::string utf8Name(std::wstring const& filename)
+{
+	std::string name;
+	appendWideAsUTF8(name, filename.data(), filename.size());
+	return name;
+}
+#endif
+
+MappedFile::MappedFile(void)
+	: addr(nullptr)
+	, length(0)
+#ifdef _WIN32
+	, mapping(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(std::wstring const& filename)
+{
+	close();
+#ifdef _WIN32
+	HANDLE const file = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return false;
+	LARGE_INTEGER size;
+	bool ok = GetFileSizeEx(file, &size) && (unsigned long long)size.QuadPart <= (size_t)-1;
+	if (ok && size.QuadPart) { // empty file can't be mapped
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		addr = mapping ? (char const*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		ok = nullptr != addr;
+		length = ok ? (size_t)size.QuadPart : 0;
+	}
+	CloseHandle(file);
+	if (!ok)
+		close();
+	return ok;
+#else
+	int fd;
+	do {
+		fd = ::open(utf8Name(filename).c_str(), O_RDONLY | O_CLOEXEC);
+	} while (fd < 0 && EINTR == errno);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool ok = 0 == ::fstat(fd, &st) && (unsigned long long)st.st_size <= (size_t)-1;
+	if (ok && st.st_size) { // empty file can't be mapped
+		void* const p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		ok = MAP_FAILED != p;
+		if (ok) {
+			addr = (char const*)p;
+			length = (size_t)st.st_size;
+		}
+	}
+	::close(fd);
+	return ok;
+#endif
+}
+
+void MappedFile::close(void)
+{
+#ifdef _WIN32
+	if (addr)
+		UnmapViewOfFile(addr);
+	if (mapping)
+		CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	if (addr)
+		::munmap(const_cast<char*>(addr), length);
+#endif
+	addr = nullptr;
+	length = 0;
+}
+
+static bool fileSize(std::wstring const& filename, unsigned long long& size)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (0 != _wstat64(filename.c_str(), &st))
+		return false;
+#else
+	struct stat st;
+	if (0 != ::stat(utf8Name(filename).c_str(), &st))
+		return false;
+#endif
+	size = (unsigned long long)st.st_size;
+	return true;
+}
+
+static std::uint64_t sinceEpoch(std::chrono::system_clock::time_point t)
+{
+	long long const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+	return ns > 0 ? (std::uint64_t)ns : 0;
+}
+
+std::vector<LogRange> findLogRanges(std::vector<std::wstring> const& filenames, std::chrono::system_clock::time_point from,
+	std::chrono::system_clock::time_point to, std::chrono::milliseconds latency)
+{
+	std::uint64_t const fromns = sinceEpoch(from);
+	std::uint64_t const tons = sinceEpoch(to + latency);
+	auto const before = [](std::uint64_t ns, LogIndexEntry const& e) { return ns < e.ns; };
+	std::vector<std::pair<std::uint64_t, LogRange>> found; // time of the first entry and range
+	MappedFile idx;
+	for (std::wstring const& filename : filenames) {
+		if (!idx.open(filename + L".idx") || idx.size() < sizeof(logindex_magic) + sizeof(LogIndexEntry)
+			|| 0 != std::memcmp(idx.data(), logindex_magic, sizeof(logindex_magic)))
+			continue;
+		LogIndexEntry const* const entries = (LogIndexEntry const*)(idx.data() + sizeof(logindex_magic)); // mapping is page aligned
+		LogIndexEntry const* const entriesend = entries + (idx.size() - sizeof(logindex_magic)) / sizeof(LogIndexEntry);
+		// lines before entry written until from were logged before from
+		LogIndexEntry const* const first = std::upper_bound(entries, entriesend, fromns, before);
+		LogIndexEntry const* const last = std::upper_bound(first, entriesend, tons, before);
+		LogRange range = { filename, first == entries ? 0 : first[-1].offset, 0 };
+		if (last != entriesend)
+			range.end = last->offset;
+		else if (!fileSize(filename, range.end)) // to the end of the file which can still be written
+			continue;
+		if (range.begin < range.end)
+			found.emplace_back(entries->ns, std::move(range));
+	}
+	std::stable_sort(found.begin(), found.end(), [](std::pair<std::uint64_t, LogRange> const& a, std::pair<std::uint64_t, LogRange> const& b) {
+		return a.first < b.first;
+	});
+	std::vector<LogRange> ranges;
+	ranges.reserve(found.size());
+	for (std::pair<std::uint64_t, LogRange>& f : found)
+		ranges.push_back(std::move(f.second));
+	return ranges;
+}
+
+}
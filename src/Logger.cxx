@@ -1,9 +1,16 @@
 #include "LoggerImpl.h"
+#include "bmu/BinLog.h"
+#include "bmu/codepoint_transform.hxx"
 #include <chrono>
 #include <sstream>
 #include <ctime>
+#include <cwchar>
 #include <fstream>
-#include <codecvt>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 #ifdef _MSC_VER
 # include <Windows.h>
 #endif
@@ -20,52 +27,90 @@ void to_localtime_thread_safe(std::time_t const& time, std::tm& tm_snapshot)
 #endif
 }
 
+/// Local time formatted with wcsftime, formatting is repeated only when second changes.
+/// Every thread has its own instances so there is no synchronization.
+class CachedTimeText {
+	CachedTimeText(CachedTimeText const&) = delete;
+	void operator = (CachedTimeText const&) = delete;
+public:
+	explicit CachedTimeText(wchar_t const* fmt)
+		: fmt(fmt)
+		, secs(-1)
+		, len(0)
+	{ }
+	/// Text for the given second, there is room after size() for the fractional part
+	wchar_t* get(std::time_t now_secs)
+	{
+		if (now_secs != secs) {
+			std::tm local_tm;
+			to_localtime_thread_safe(now_secs, local_tm);
+			len = std::wcsftime(buf, _countof(buf) - fraction_room, fmt, &local_tm);
+			secs = now_secs;
+		}
+		return buf;
+	}
+	size_t size(void) const
+	{
+		return len;
+	}
+	static size_t const fraction_room = 32;
+private:
+	wchar_t const* const fmt;
+	std::time_t          secs;
+	size_t               len;
+	wchar_t              buf[128 + fraction_room];
+};
+
+/// Fraction of the second as logmod_time has always written it, nanoseconds modulo 10^6 without leading
+/// zeros. Parsers of existing logs expect this text, \see setPrefixLayout.
+static size_t put_fraction(wchar_t* out, std::chrono::system_clock::time_point now)
+{
+	unsigned long long val = (unsigned long long)(std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() % 1000000);
+	wchar_t tmp[8];
+	size_t n = 0;
+	do {
+		tmp[n++] = (wchar_t)(L'0' + val % 10);
+		val /= 10;
+	} while (val);
+	for (size_t i = 0; i < n; ++i)
+		out[i] = tmp[n - 1 - i];
+	return n;
+}
+
 void logmod_date(StdBufPtr to_out)
 {
+	thread_local CachedTimeText text(L"%x "); // %x writes localized date representation
 	auto now = std::chrono::system_clock::now(); // system time
-	auto now_time_t = std::chrono::system_clock::to_time_t(now);
-	std::tm local_tm;
-	to_localtime_thread_safe(now_time_t, local_tm);
-	wchar_t buf[128];
-	size_t cch = std::wcsftime(buf, _countof(buf), L"%x ", &local_tm); // %x writes localized date representation
-	to_out->sputn(buf, cch);
+	wchar_t const* buf = text.get(std::chrono::system_clock::to_time_t(now));
+	to_out->sputn(buf, text.size());
 }
 
 void logmod_time(StdBufPtr to_out)
 {
+	thread_local CachedTimeText text(L"%X."); // %X writes localized time representation
 	auto now = std::chrono::system_clock::now(); // system time
-	{
-		auto now_time_t = std::chrono::system_clock::to_time_t(now);
-		std::tm local_tm;
-		to_localtime_thread_safe(now_time_t, local_tm);
-		wchar_t buf[128];
-		size_t cch = std::wcsftime(buf, _countof(buf), L"%X.", &local_tm);// %X writes localized time representation
-		to_out->sputn(buf, cch);
-	}
-	{
-		const std::chrono::duration<double> tse = now.time_since_epoch();
-		std::chrono::seconds::rep usec = std::chrono::duration_cast<std::chrono::nanoseconds>(tse).count() % 1000000;
-		std::wstring usstr(std::to_wstring(usec) + L" ");
-		to_out->sputn(&usstr[0], usstr.size());
-	}
+	wchar_t* buf = text.get(std::chrono::system_clock::to_time_t(now));
+	size_t cch = text.size();
+	cch += put_fraction(buf + cch, now); // only fractional part is rewritten for every line
+	buf[cch++] = L' ';
+	to_out->sputn(buf, cch);
 }
 
 void logmod_datetime(StdBufPtr to_out)
 {
+	thread_local CachedTimeText text(L"%y%m%d-%H%M%S "); // %x writes time representation in short form
 	auto now = std::chrono::system_clock::now(); // system time
-	auto now_time_t = std::chrono::system_clock::to_time_t(now);
-	std::tm local_tm;
-	to_localtime_thread_safe(now_time_t, local_tm);
-	wchar_t buf[128];
-	size_t cch = std::wcsftime(buf, _countof(buf), L"%y%m%d-%H%M%S ", &local_tm); // %x writes time representation in short form
-	to_out->sputn(buf, cch);
+	wchar_t const* buf = text.get(std::chrono::system_clock::to_time_t(now));
+	to_out->sputn(buf, text.size());
 }
 
 void logmod_threadid(StdBufPtr to_out)
 {
-	std::wostringstream oss;
-	oss << this_thread::get_id() << " ";
-	std::wstring const str(oss.str());
+	thread_local std::wstring const str([] { // thread id doesn't change so it's formatted only once
+		std::wostringstream oss;
+		oss << this_thread::get_id() << " ";
+		return oss.str();
+	}());
 	to_out->sputn(&str[0], str.size());
 }
 
@@ -110,6 +155,22 @@ char const* to_string(loglevel_e lvl)
 std::shared_ptr<SharedThreadStr> logmanip::indentation_str(std::make_shared<SharedThreadStr>());
 std::shared_ptr<SharedThreadStr> logmanip::threadname_str(std::make_shared<SharedThreadStr>());
 LogScopePtr logmanip::current_scope;
+thread_local loglevel_e logmanip::line_level = LINFO;
+thread_local bool logmanip::line_output = true;
+std::atomic<int> logmanip::current_level(LINFO);
+std::atomic<int> logmanip::output_level(LINFO);
+std::atomic<int> logmanip::queued_level(LINFO);
+std::atomic<int> logmanip::enabled_level(LINFO);
+int logmanip::recorder_level = -1;
+int logmanip::output_maxlevel = LDUMP;
+int logmanip::sink_maxlevel = -1;
+
+/// Guards LogScope tree (children, own levels) and current scope. Only changes are locked.
+static std::mutex& logscope_tree_mutex(void)
+{
+	static std::mutex mutex;
+	return mutex;
+}
 
 std::wstring getDateTimeFilenameSuffix(void)
 {
@@ -133,21 +194,41 @@ void logmanip::setThreadName(std::wstring const& name)
 	threadname_str->getStr() = name;
 }
 
-bool logmanip::isEnabled(loglevel_e wanted)
+std::wstring const& logmanip::getThreadName(void)
+{
+	return threadname_str->getStr();
+}
+
+void logmanip::setScope(LogScopePtr new_scope)
 {
-	return current_scope
-		? current_scope->isEnabled(wanted)
-		: wanted <= LINFO;
+	std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+	current_scope.swap(new_scope); // previous scope is released after unlock, its destructor locks
+	storeLevels(current_scope ? current_scope->effective.load(std::memory_order_relaxed) : (int)LINFO, recorder_level);
 }
 
-LogModifierFn logmanip::getLogModifierIndentation(void)
+void logmanip::setRecorderLevel(int recorderlevel)
 {
-	return make_logmod_tss_string(indentation_str);
+	std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+	storeLevels(current_level.load(std::memory_order_relaxed), recorderlevel);
 }
 
-LogModifierFn logmanip::getLogModifierThreadname(void)
+void logmanip::setOutputLevels(int outputlevel, int sinklevel)
 {
-	return make_logmod_tss_string(threadname_str);
+	std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+	output_maxlevel = outputlevel;
+	sink_maxlevel = sinklevel;
+	storeLevels(current_level.load(std::memory_order_relaxed), recorder_level);
+}
+
+void logmanip::storeLevels(int scopelevel, int recorderlevel)
+{
+	recorder_level = recorderlevel;
+	int const output = scopelevel < output_maxlevel ? scopelevel : output_maxlevel;
+	int const queued = output > sink_maxlevel ? output : sink_maxlevel;
+	current_level.store(scopelevel, std::memory_order_relaxed);
+	output_level.store(output, std::memory_order_relaxed);
+	queued_level.store(queued, std::memory_order_relaxed);
+	enabled_level.store(queued > recorderlevel ? queued : recorderlevel, std::memory_order_relaxed);
 }
 
 void logmanip::update(logmanip::type_e m)
@@ -166,14 +247,24 @@ void logmanip::update(logmanip::type_e m)
 
 LogScope::LogScope(LogScopePtr parent)
 	: parent(parent)
-	, level()
+	, children()
+	, haslevel(false)
+	, level(LINFO)
+	, effective(LINFO)
 {
 	if (parent) {
-		LogScopePtr eff(parent);
-		while (!eff->level && eff->parent)
-			eff = eff->parent;
-		if (eff)
-			level = eff->level; // inherited level
+		std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+		parent->children.push_back(this);
+		effective.store(parent->effective.load(std::memory_order_relaxed), std::memory_order_relaxed); // inherited level
+	}
+}
+
+LogScope::~LogScope()
+{
+	if (parent) {
+		std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+		auto& siblings(parent->children);
+		siblings.erase(std::remove(siblings.begin(), siblings.end(), this), siblings.end());
 	}
 }
 
@@ -184,296 +275,1334 @@ LogScopePtr LogScope::create(LogScopePtr parent)
 
 void LogScope::setLoglevel(loglevel_e newlevel)
 {
-	level = std::make_shared<loglevel_e>(newlevel);
+	std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+	haslevel = true;
+	level = newlevel;
+	propagate(newlevel);
 }
 
-bool LogScope::isEnabled(loglevel_e wanted)
+void LogScope::resetLoglevel(void)
 {
-	loglevel_e efflevel = level ? *level : LINFO;
-	return wanted <= efflevel;
+	std::lock_guard<std::mutex> lock(logscope_tree_mutex());
+	haslevel = false;
+	propagate(parent ? parent->effective.load(std::memory_order_relaxed) : (int)LINFO);
 }
 
-void BufferWriterWithModifers::setModifiers(std::list<LogModifierFn> newmodifers)
+void LogScope::propagate(int efflevel)
 {
-	modifiers.clear();
-	for (auto& mod : newmodifers) {
-		if (mod)
-			modifiers.push_back(mod);
+	effective.store(efflevel, std::memory_order_relaxed);
+	if (logmanip::current_scope.get() == this)
+		logmanip::storeLevels(efflevel, logmanip::recorder_level);
+	for (LogScope* child : children) {
+		if (!child->haslevel)
+			child->propagate(efflevel);
 	}
 }
 
-void BufferWriterWithModifers::do_write_modifiers(StdBufPtr sbuf)
+void BufferWriterWithModifers::setLayout(PrefixLayoutPtr newlayout)
 {
-	//for (auto& mod : modifiers)
-	//	mod(sbuf); // it's checked in setModifiers if null
-	//for (auto i = modifiers.begin(); i != modifiers.end(); ++i) {
-	//	auto& mod(*i);
-	for (size_t i = 0; i < modifiers.size(); ++i) {
-		auto it = modifiers.begin();
-		std::advance(it, i);
-		auto& mod(*it);
-		mod(sbuf); // it's checked in setModifiers if null
-	}
+	std::lock_guard<std::mutex> lock(layoutslock);
+	layout.store(newlayout.get(), std::memory_order_seq_cst);
+	TargetReaders::synchronize(); // no thread renders the previous one any more
+	owned = newlayout;
+}
+
+StagingBuf& BufferWriterWithModifers::do_render_modifiers(void)
+{
+	StdBufPtr stagingptr;
+	StagingBuf& staging = StagingBuf::forThread(stagingptr);
+	staging.clear();
+	TargetReaders::Scope reading; // layout isn't released while it's rendered
+	if (PrefixLayout const* current = layout.load(std::memory_order_seq_cst))
+		current->render(staging, stagingptr);
+	return staging;
+}
+
+/// Per-thread line for direct writers, keeps its capacity
+static std::string& utf8LineForThread(void)
+{
+	thread_local std::string line;
+	line.clear();
+	return line;
+}
+
+std::string const& BufferWriterWithModifers::do_format_line(wchar_t const* s, std::streamsize n)
+{
+	StagingBuf& staging = do_render_modifiers();
+	std::string& line = utf8LineForThread();
+	appendWideAsUTF8(line, staging.data(), staging.size());
+	appendWideAsUTF8(line, s, (size_t)n);
+	return line;
 }
 
-std::streamsize BufferWriterWithModifers::do_write_string(StdBufPtr sbuf, wchar_t const* s, std::streamsize n)
+std::string const& BufferWriterWithModifers::do_format_line(char const* s, std::streamsize n)
+{
+	StagingBuf& staging = do_render_modifiers();
+	std::string& line = utf8LineForThread();
+	appendWideAsUTF8(line, staging.data(), staging.size());
+	line.append(s, (size_t)n);
+	return line;
+}
+
+std::streamsize BufferWriterWithModifers::do_write_string(Utf8BufPtr sbuf, char const* s, std::streamsize n)
 {
 	return sbuf->sputn(s, n);
 }
 
 std::streamsize DirectWriter::write(wchar_t const* s, std::streamsize n)
 {
-	BufferWriterWithModifers::do_write_modifiers(sbuf);
-	return BufferWriterWithModifers::do_write_string(sbuf, s, n);
+	std::string const& line = do_format_line(s, n);
+	do_write_string(sbuf, line.data(), line.size());
+	return n;
+}
+
+std::streamsize DirectWriter::write(char const* s, std::streamsize n)
+{
+	std::string const& line = do_format_line(s, n);
+	do_write_string(sbuf, line.data(), line.size());
+	return n;
+}
+
+/// Thread-local slot of thread log, trivial types so reading them needs no initialization check.
+/// tlog_file owns the file, it's used only when slot is resolved.
+static thread_local LogsFactoryImpl const* tlog_owner = nullptr;
+static thread_local unsigned int tlog_resolved = 0; // tlog_generation of the slot, 0 for never resolved
+static thread_local std::streambuf* tlog_sbuf = nullptr;
+static thread_local Utf8BufPtr tlog_file;
+
+std::atomic<unsigned int> LogsFactoryImpl::tlog_generation(1);
+
+std::streambuf* LogsFactoryImpl::getTlogStreambuf(void)
+{
+	if (tlog_resolved == tlog_generation.load(std::memory_order_acquire) && tlog_owner == this)
+		return tlog_sbuf;
+	return resolveTlogStreambuf();
 }
 
 std::streamsize TargetDirectWriter::write(wchar_t const* s, std::streamsize n)
 {
-	StdBufPtr sbuf = getsbuf();
-	if (sbuf) {
-		BufferWriterWithModifers::do_write_modifiers(sbuf);
-		return BufferWriterWithModifers::do_write_string(sbuf, s, n);
+	if (std::streambuf* const sbuf = factory.getTlogStreambuf()) {
+		if (!logmanip::isPrimaryOutput(logmanip::lineLevel()))
+			return n; // enabled only for sinks of clog
+		std::string const& line = do_format_line(s, n);
+		sbuf->sputn(line.data(), line.size());
+		return n;
+	}
+	return fallback->write(s, n);
+}
+
+std::streamsize TargetDirectWriter::write(char const* s, std::streamsize n)
+{
+	if (std::streambuf* const sbuf = factory.getTlogStreambuf()) {
+		if (!logmanip::isPrimaryOutput(logmanip::lineLevel()))
+			return n; // enabled only for sinks of clog
+		std::string const& line = do_format_line(s, n);
+		sbuf->sputn(line.data(), line.size());
+		return n;
 	}
 	return fallback->write(s, n);
 }
 
-QueueWriter::QueueWriter(StdBufPtr sbuf, RotateFileFn rotate, std::shared_ptr<size_t> bymax)
+QueueWriter::QueueWriter(Utf8BufPtr sbuf, OpenNextFileFn opennext, RotationSizePtr bymax, QueuePolicy const& policy, BinBufPtr binsbuf, SinkRegistryPtr sinks)
 	: sbuf(sbuf)
-	, rotate(rotate)
+	, nextsbuf()
+	, binsbuf(binsbuf)
+	, sinks(sinks)
+	, opennext(opennext)
 	, bymax(bymax)
 	, bycount(0)
+	, openretry(0)
+	, overflow(policy.overflow)
+	, keeplevel(policy.keeplevel)
+	, dropreportms(policy.dropreportms)
+	, dropped(0)
+	, coalescebytes(policy.coalescebytes)
+	, coalescems(policy.coalescems)
+	, coalescedlock()
+	, coalesced()
 	, finish(false)
 	, allwrite(true)
-	, mutex()
-	, logs(std::make_shared<MsgQueue>())
+	, records(0)
+	, bytes(0)
+	, rotations(0)
+	, logs(policy.capacity)
+	, logs_ready()
+	, logs_room()
 	, worker(bind(&QueueWriter::BackendWorker, this))
 { 
+	FlightRecorder::addWriter(this);
 }
 
 QueueWriter::~QueueWriter(void)
 {
+	FlightRecorder::removeWriter(this);
+	flushCoalesced();
+	{
+		std::lock_guard<std::mutex> lock(coalescedlock);
+		for (CoalescedLinesPtr const& lines : coalesced)
+			lines->closed.store(true, std::memory_order_release);
+	}
 	finish = true;
+	logs_ready.notify_one();
 	if(worker.get_id() != this_thread::get_id())
 		worker.join();
+	if (nextsbuf)
+		nextsbuf->removeIfUnused();
 }
 
-std::streamsize QueueWriter::write(wchar_t const* s, std::streamsize n)
+StagingBuf& StagingBuf::forThread(StdBufPtr& asptr)
+{
+	thread_local StagingBuf staging;
+	thread_local StdBufPtr const stagingptr(&staging, [](std::wstreambuf*) { });
+	asptr = stagingptr;
+	return staging;
+}
+
+void StagingBuf::grow(size_t atleast)
 {
-	std::wstringbuf tmpbuf;
-	StdBufPtr sptmpbuf(&tmpbuf, [](std::wstringbuf*p) { });
-	BufferWriterWithModifers::do_write_modifiers(sptmpbuf);
-	std::wstring prefixstr(tmpbuf.str());
+	size_t const used = size();
+	size_t newsize = buf.size() * 2;
+	while (newsize < used + atleast)
+		newsize *= 2;
+	buf.resize(newsize);
+	setp(&buf[0], &buf[0] + buf.size());
+	pbump((int)used);
+}
+
+StagingBuf::int_type StagingBuf::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+	grow(1);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+std::streamsize StagingBuf::xsputn(wchar_t const* s, std::streamsize n)
+{
+	append(s, (size_t)n);
+	return n;
+}
+
+void PrefixLayout::add(field_e type)
+{
+	fields.push_back(field{ type, 0, 0 });
+	if (field_date == type || field_time == type || field_usec == type || field_datetime == type)
+		clock = true;
+}
+
+void PrefixLayout::addText(wchar_t const* s, size_t n)
+{
+	if (!n)
+		return;
+	if (!fields.empty() && field_text == fields.back().type)
+		fields.back().len += n; // adjacent text is one field
+	else
+		fields.push_back(field{ field_text, text.size(), n });
+	text.append(s, n);
+}
+
+PrefixLayoutPtr PrefixLayout::compile(std::wstring const& pattern)
+{
+	static struct {
+		wchar_t const* name;
+		field_e        type;
+	} const names[] = { // longer names before their prefixes
+		{ L"%DT", field_datetime },
+		{ L"%D", field_date },
+		{ L"%T", field_time },
+		{ L"%us", field_usec },
+		{ L"%tid", field_threadid },
+		{ L"%tname", field_threadname },
+		{ L"%indent", field_indent },
+	};
+	std::shared_ptr<PrefixLayout> compiled(new PrefixLayout);
+	for (size_t i = 0; i < pattern.size(); ) {
+		if (L'%' != pattern[i]) {
+			size_t const next = pattern.find(L'%', i);
+			size_t const n = (std::wstring::npos == next ? pattern.size() : next) - i;
+			compiled->addText(&pattern[i], n);
+			i += n;
+			continue;
+		}
+		if (0 == pattern.compare(i, 2, L"%%")) {
+			compiled->addText(L"%", 1);
+			i += 2;
+			continue;
+		}
+		size_t matched = 0;
+		for (auto const& name : names) {
+			size_t const len = std::wcslen(name.name);
+			if (0 == pattern.compare(i, len, name.name)) {
+				compiled->add(name.type);
+				matched = len;
+				break;
+			}
+		}
+		if (!matched) { // unknown sequence is copied
+			compiled->addText(&pattern[i], 1);
+			matched = 1;
+		}
+		i += matched;
+	}
+	return compiled;
+}
+
+PrefixLayoutPtr PrefixLayout::fromModifiers(std::list<LogModifierFn> const& modifiers)
+{
+	typedef void(*modfn_t)(StdBufPtr);
+	std::shared_ptr<PrefixLayout> compiled(new PrefixLayout);
+	for (LogModifierFn const& mod : modifiers) {
+		if (!mod)
+			continue;
+		modfn_t const* fn = mod.target<modfn_t>();
+		if (fn && &logmod_date == *fn) {
+			compiled->add(field_date);
+			compiled->addText(L" ", 1);
+		}
+		else if (fn && &logmod_time == *fn) {
+			compiled->add(field_time);
+			compiled->addText(L".", 1);
+			compiled->add(field_usec);
+			compiled->addText(L" ", 1);
+		}
+		else if (fn && &logmod_datetime == *fn) {
+			compiled->add(field_datetime);
+			compiled->addText(L" ", 1);
+		}
+		else if (fn && &logmod_threadid == *fn) {
+			compiled->add(field_threadid);
+			compiled->addText(L" ", 1);
+		}
+		else {
+			compiled->fields.push_back(field{ field_modifier, compiled->modifiers.size(), 0 });
+			compiled->modifiers.push_back(mod);
+		}
+	}
+	compiled->add(field_indent); // indentation is always active
+	compiled->add(field_threadname);
+	return compiled;
+}
+
+void PrefixLayout::render(StagingBuf& out, StdBufPtr const& asptr) const
+{
+	std::chrono::system_clock::time_point const now = clock ? std::chrono::system_clock::now() : std::chrono::system_clock::time_point();
+	std::time_t const secs = std::chrono::system_clock::to_time_t(now);
+	for (field const& f : fields) {
+		switch (f.type) {
+		case field_text:
+			out.append(&text[f.index], f.len);
+			break;
+		case field_date: {
+			thread_local CachedTimeText date(L"%x"); // %x writes localized date representation
+			wchar_t const* buf = date.get(secs);
+			out.append(buf, date.size());
+			break;
+		}
+		case field_time: {
+			thread_local CachedTimeText time(L"%X"); // %X writes localized time representation
+			wchar_t const* buf = time.get(secs);
+			out.append(buf, time.size());
+			break;
+		}
+		case field_usec: {
+			wchar_t buf[8];
+			out.append(buf, put_fraction(buf, now));
+			break;
+		}
+		case field_datetime: {
+			thread_local CachedTimeText datetime(L"%y%m%d-%H%M%S");
+			wchar_t const* buf = datetime.get(secs);
+			out.append(buf, datetime.size());
+			break;
+		}
+		case field_threadid: {
+			thread_local std::wstring const id([] { // thread id doesn't change so it's formatted only once
+				std::wostringstream oss;
+				oss << this_thread::get_id();
+				return oss.str();
+			}());
+			out.append(id.data(), id.size());
+			break;
+		}
+		case field_threadname: {
+			thread_local std::wstring const& name(logmanip::threadname_str->getStr()); // the same string for the whole thread
+			out.append(name.data(), name.size());
+			break;
+		}
+		case field_indent: {
+			thread_local std::wstring const& indentation(logmanip::indentation_str->getStr());
+			out.append(indentation.data(), indentation.size());
+			break;
+		}
+		case field_modifier:
+			modifiers[f.index](asptr);
+			break;
+		}
+	}
+}
+
+AtomicHistogram::AtomicHistogram(void)
+	: sum(0)
+	, max(0)
+{
+	for (std::atomic<unsigned long long>& c : counts)
+		c.store(0, std::memory_order_relaxed);
+}
+
+void AtomicHistogram::add(unsigned long long v)
+{
+	size_t bucket = 0;
+	for (unsigned long long rest = v; rest; rest >>= 1)
+		++bucket;
+	counts[bucket < LogHistogram::buckets ? bucket : LogHistogram::buckets - 1].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(v, std::memory_order_relaxed);
+	unsigned long long m = max.load(std::memory_order_relaxed);
+	while (v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed))
+		;
+}
+
+void AtomicHistogram::mergeInto(LogHistogram& h) const
+{
+	for (size_t i = 0; i < LogHistogram::buckets; ++i) {
+		unsigned long long const c = counts[i].load(std::memory_order_relaxed);
+		h.counts[i] += c;
+		h.samples += c;
+	}
+	h.sum += sum.load(std::memory_order_relaxed);
+	unsigned long long const m = max.load(std::memory_order_relaxed);
+	if (m > h.max)
+		h.max = m;
+}
+
+unsigned long long LogHistogram::percentile(double fraction) const
+{
+	unsigned long long const wanted = (unsigned long long)(fraction * samples + 0.5);
+	unsigned long long below = 0;
+	for (size_t i = 0; i < buckets; ++i) {
+		below += counts[i];
+		if (below >= wanted && below) {
+			unsigned long long const upper = i ? (1ull << i) - 1 : 0;
+			return i + 1 < buckets && upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
+void QueueWriter::setPolicy(QueuePolicy const& policy)
+{
+	overflow.store(policy.overflow, std::memory_order_relaxed);
+	keeplevel.store(policy.keeplevel, std::memory_order_relaxed);
+	dropreportms.store(policy.dropreportms, std::memory_order_relaxed);
+	coalescems.store(policy.coalescems, std::memory_order_relaxed);
+	coalescebytes.store(policy.coalescebytes, std::memory_order_relaxed);
+	if (!policy.coalescebytes)
+		flushCoalesced(); // the next lines are queued directly
+	logs_ready.notify_one(); // backend waits with the new timeout
+	logs_room.notify_all(); // blocked producers may drop now
+}
+
+template<typename _Fn>
+void QueueWriter::push(_Fn&& fill, loglevel_e lvl)
+{
+	std::uint64_t const now = steadyNanos();
+	bool const output = logmanip::isPrimaryOutput(lvl); // level of outputs can change before backend writes it
+	auto stamped = [&](LogRecord& rec) {
+		rec.enqueuedns = now;
+		rec.level = lvl;
+		rec.output = output;
+		rec.coalesced = false;
+		fill(rec);
+	};
+	bool waited = false;
+	while (!logs.try_push(stamped)) { // full, backend has to make room
+		waited = true;
+		int const ov = overflow.load(std::memory_order_relaxed);
+		int const keep = keeplevel.load(std::memory_order_relaxed);
+		if (OVERFLOW_DROP_NEWEST == ov || (OVERFLOW_DROP_BELOW_LEVEL == ov && lvl > keep)) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		if (OVERFLOW_DROP_OLDEST == ov && logs.try_pop([](LogRecord& /*rec*/) { })) { // makes room even if backend is stuck
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		logs_ready.notify_one();
+		logs_room.wait([&] { return !logs.full() || ov != overflow.load(std::memory_order_relaxed) || keep != keeplevel.load(std::memory_order_relaxed); });
+	}
+	if (waited)
+		waitns.local().add(steadyNanos() - now);
+	logs_ready.notify_one();
+}
+
+void QueueWriter::rotateIfFull(size_t len)
+{
+	bycount += len;
+	size_t const limit = bymax->load(std::memory_order_relaxed);
+	if (!nextsbuf && bycount >= limit / 4 * 3 && bycount >= openretry) {
+		std::uint64_t const start = steadyNanos();
+		nextsbuf = opennext(); // ahead, so file system work isn't done at the moment of rotation
+		rotationns.add(steadyNanos() - start);
+		if (!nextsbuf) // not for every record, each failure is reported
+			openretry = bycount + limit / 4;
+	}
+	if (bycount < limit || !nextsbuf)
+		return; // stays in the current file until the next one is opened
+	std::uint64_t const start = steadyNanos();
+	sbuf->pubsync();
+	sbuf = nextsbuf; // previous file is closed here
+	nextsbuf.reset();
+	bycount = 0;
+	openretry = 0;
+	rotations.fetch_add(1, std::memory_order_relaxed);
+	rotationns.add(steadyNanos() - start);
+}
+
+void QueueWriter::getStats(LogWriterStats& stats) const
+{
+	stats.queuedepth += logs.size_approx();
+	stats.queuecapacity += logs.capacity();
+	stats.records += records.load(std::memory_order_relaxed);
+	stats.bytes += bytes.load(std::memory_order_relaxed);
+	stats.dropped += dropped.load(std::memory_order_relaxed);
+	stats.rotations += rotations.load(std::memory_order_relaxed);
+	latencyns.mergeInto(stats.latencyns);
+	batchrecords.mergeInto(stats.batchrecords);
+	batchns.mergeInto(stats.batchns);
+	rotationns.mergeInto(stats.rotationns);
+	waitns.forEach([&](AtomicHistogram const& h) { h.mergeInto(stats.waitns); });
+}
+
+/// Lines of this thread for every writer which collects them. When thread ends backend queues the rest.
+struct ThreadCoalescedLines {
+	std::vector<CoalescedLinesPtr> list;
+	~ThreadCoalescedLines()
 	{
-		std::lock_guard<std::mutex> lock(mutex);
-		if (!prefixstr.empty())
-			logs->push_back({ &prefixstr[0], (size_t)prefixstr.size() });
-		logs->push_back({ s, (size_t)n });
+		for (CoalescedLinesPtr const& lines : list) {
+			std::lock_guard<std::mutex> lock(lines->lock);
+			lines->orphan = true;
+		}
+	}
+};
+
+CoalescedLines& QueueWriter::coalescedForThread(void)
+{
+	thread_local ThreadCoalescedLines mine;
+	for (size_t i = 0; i < mine.list.size(); ) {
+		CoalescedLines& lines = *mine.list[i];
+		bool const closed = lines.closed.load(std::memory_order_acquire);
+		if (this == lines.writer && !closed)
+			return lines;
+		if (closed) // new writer can have the same address
+			mine.list.erase(mine.list.begin() + i);
+		else
+			++i;
 	}
-	bycount += prefixstr.size() + (size_t)n;
-	if (rotate && bymax && bycount >= *bymax) {
-		bycount = 0;
-		rotate();
+	CoalescedLinesPtr lines(std::make_shared<CoalescedLines>());
+	lines->firstns = 0;
+	lines->level = LINFO;
+	lines->output = true;
+	lines->writer = this;
+	lines->closed.store(false, std::memory_order_relaxed);
+	lines->orphan = false;
+	{
+		std::lock_guard<std::mutex> lock(coalescedlock);
+		coalesced.push_back(lines);
 	}
+	mine.list.push_back(lines);
+	return *lines;
+}
+
+bool QueueWriter::queueCoalesced(CoalescedLines& lines, bool wait)
+{
+	auto fill = [&](LogRecord& rec) { // capacity of the cell goes to collected lines
+		rec.text.swap(lines.text);
+		rec.bin.clear();
+		rec.enqueuedns = lines.firstns; // latency of the oldest line
+		rec.level = lines.level;
+		rec.output = lines.output;
+		rec.coalesced = true;
+	};
+	if (wait)
+		push(fill, lines.level);
+	else if (!logs.try_push(fill))
+		return false;
+	lines.text.clear(); // also when push dropped them
+	return true;
+}
+
+template<typename _Fn>
+void QueueWriter::coalesce(_Fn&& append, loglevel_e lvl)
+{
+	bool const output = logmanip::isPrimaryOutput(lvl);
+	CoalescedLines& lines = coalescedForThread();
+	std::lock_guard<std::mutex> lock(lines.lock);
+	if (!lines.text.empty() && (lines.level != lvl || lines.output != output)) // sinks and overflow policy need one level
+		queueCoalesced(lines, true);
+	if (lines.text.empty()) {
+		lines.firstns = steadyNanos();
+		lines.level = lvl;
+		lines.output = output;
+	}
+	append(lines.text);
+	if (lines.text.size() >= coalescebytes.load(std::memory_order_relaxed))
+		queueCoalesced(lines, true);
+}
+
+void QueueWriter::flushCoalesced(void)
+{
+	std::lock_guard<std::mutex> listlock(coalescedlock);
+	for (CoalescedLinesPtr const& lines : coalesced) {
+		std::lock_guard<std::mutex> lock(lines->lock);
+		if (!lines->text.empty())
+			queueCoalesced(*lines, true);
+	}
+}
+
+void QueueWriter::drain(void)
+{
+	flushCoalesced();
+	drained.wait(logs.enqueued(), [this] { logs_ready.notify_one(); });
+}
+
+void QueueWriter::queueExpired(void)
+{
+	std::unique_lock<std::mutex> listlock(coalescedlock, std::try_to_lock);
+	if (!listlock.owns_lock()) // flush is in progress
+		return;
+	std::uint64_t const maxns = (std::uint64_t)coalescems.load(std::memory_order_relaxed) * 1000000;
+	std::uint64_t const now = steadyNanos();
+	for (size_t i = 0; i < coalesced.size(); ) {
+		CoalescedLines& lines = *coalesced[i];
+		std::unique_lock<std::mutex> lock(lines.lock, std::try_to_lock);
+		if (!lock.owns_lock()) { // thread is adding line, it may be waiting for this backend
+			++i;
+			continue;
+		}
+		if (!lines.text.empty() && (lines.orphan || now - lines.firstns >= maxns) && !queueCoalesced(lines, false)) {
+			++i; // queue is full, it's tried after the backend makes room
+			continue;
+		}
+		bool const forget = lines.orphan && lines.text.empty();
+		lock.unlock();
+		if (forget)
+			coalesced.erase(coalesced.begin() + i);
+		else
+			++i;
+	}
+}
+
+std::streamsize QueueWriter::write(wchar_t const* s, std::streamsize n)
+{
+	StagingBuf& staging = do_render_modifiers();
+	if (coalescebytes.load(std::memory_order_relaxed)) {
+		coalesce([&](std::string& text) {
+			appendWideAsUTF8(text, staging.data(), staging.size());
+			appendWideAsUTF8(text, s, (size_t)n);
+		}, logmanip::lineLevel());
+		return n;
+	}
+	push([&](LogRecord& rec) { // one record with prefix and message, reuses cell capacity
+		rec.text.clear();
+		appendWideAsUTF8(rec.text, staging.data(), staging.size());
+		appendWideAsUTF8(rec.text, s, (size_t)n);
+		rec.bin.clear();
+	}, logmanip::lineLevel());
+	return n;
+}
+
+std::streamsize QueueWriter::write(char const* s, std::streamsize n)
+{
+	StagingBuf& staging = do_render_modifiers();
+	if (coalescebytes.load(std::memory_order_relaxed)) {
+		coalesce([&](std::string& text) {
+			appendWideAsUTF8(text, staging.data(), staging.size());
+			text.append(s, (size_t)n);
+		}, logmanip::lineLevel());
+		return n;
+	}
+	push([&](LogRecord& rec) { // UTF-8 message is copied as is
+		rec.text.clear();
+		appendWideAsUTF8(rec.text, staging.data(), staging.size());
+		rec.text.append(s, (size_t)n);
+		rec.bin.clear();
+	}, logmanip::lineLevel());
 	return n;
 }
 
+void QueueWriter::writeBinary(char const* data, size_t n, loglevel_e lvl)
+{
+	push([&](LogRecord& rec) {
+		rec.text.clear();
+		rec.bin.assign(data, n);
+	}, lvl);
+}
+
 void QueueWriter::BackendWorker(void)
 {
 #ifndef NDEBUG
 	bmu::logmanip::setThreadName(L"##### BackendWorker thread #####");
 #endif
-	MsgQueue  tmplogs;
-	do {
-		if (logs->empty()) {
-			this_thread::sleep_for(std::chrono::milliseconds(10));
-			continue;
+	BackendThreadScope backend;
+	std::vector<bool>                bindefined; // format descriptors already written to binsbuf
+	std::vector<BinlogFormat const*> binformats; // cache of registry lookups
+	std::string                      bintext;
+	bool const                       rotating = sbuf && opennext && bymax;
+	unsigned long long               reported = 0; // dropped records already reported
+	auto                             lastreport = std::chrono::steady_clock::now();
+	size_t                           sincecheck = 0;
+	unsigned long long               batchcount = 0;
+	SinkRegistry::ListPtr            sinklist;
+	unsigned int                     sinkversion = 0;
+	auto to_sinks = [&](char const* line, size_t n, loglevel_e lvl) { // the same formatted line for every sink
+		for (SinkRegistry::entry const& e : sinklist->entries) {
+			if (lvl > e.maxlevel)
+				continue;
+			if (sinklist->pool)
+				sinklist->pool->write(e.worker, e.sink, line, n, lvl);
+			else
+				e.sink->write(line, n, lvl);
 		}
-		else {
-			std::lock_guard<std::mutex> lock(mutex);
-			tmplogs = std::move(*logs);
-		}
-		while (!tmplogs.empty()) {
-			if (!allwrite && finish)
-				return;
-			std::wstring& val(tmplogs.front());
-			if (!tmplogs.front().empty()) {
-				BufferWriterWithModifers::do_write_string(sbuf, &val[0], val.size());
-				tmplogs.pop_front();
+	};
+	if (sinks)
+		sinks->refresh(sinkversion, sinklist);
+	auto report_dropped = [&] {
+		unsigned long long const total = dropped.load(std::memory_order_relaxed);
+		if (total == reported || !sbuf)
+			return;
+		auto const now = std::chrono::steady_clock::now();
+		if (now - lastreport < std::chrono::milliseconds(dropreportms.load(std::memory_order_relaxed)))
+			return;
+		char line[96];
+		int const cch = std::snprintf(line, sizeof(line), "**** %llu log records dropped ****\n", total - reported);
+		if (cch > 0) {
+			BufferWriterWithModifers::do_write_string(sbuf, line, cch);
+			if (rotating)
+				rotateIfFull((size_t)cch);
+			if (sinklist)
+				to_sinks(line, (size_t)cch, LWARN);
+		}
+		reported = total;
+		lastreport = now;
+	};
+	LogRecord current = LogRecord(); // for OVERFLOW_DROP_OLDEST cell is given back before the record is written,
+	auto copy_record = [&](LogRecord& rec) { // so stuck sink doesn't keep producers from dropping
+		current = rec; // reuses capacity
+	};
+	auto write_record = [&](LogRecord& rec) {
+		if (++sincecheck == 256) { // backend may be busy without draining the queue
+			sincecheck = 0;
+			report_dropped();
+		}
+		++batchcount;
+		records.store(records.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		latencyns.add(steadyNanos() - rec.enqueuedns);
+		bytes.store(bytes.load(std::memory_order_relaxed) + rec.text.size() + rec.bin.size(), std::memory_order_relaxed);
+		bool const output = rec.output; // otherwise it's queued only for sinks
+		if (!rec.text.empty()) {
+			if (output) {
+				BufferWriterWithModifers::do_write_string(sbuf, &rec.text[0], rec.text.size());
+				if (rotating)
+					rotateIfFull(rec.text.size());
+			}
+			if (sinklist && rec.coalesced) {
+				for (size_t pos = 0; pos < rec.text.size(); ) { // sinks get line by line
+					size_t const eol = rec.text.find('\n', pos);
+					size_t const end = std::string::npos == eol ? rec.text.size() : eol + 1;
+					to_sinks(&rec.text[pos], end - pos, rec.level);
+					pos = end;
+				}
 			}
+			else if (sinklist)
+				to_sinks(rec.text.data(), rec.text.size(), rec.level);
+		}
+		if (rec.bin.empty())
+			return;
+		if (binsbuf) {
+			if (output)
+				writeBinlogEntry(*binsbuf, bindefined, rec.bin.data(), rec.bin.size());
+			return;
+		}
+		std::uint32_t id = 0;
+		std::memcpy(&id, rec.bin.data(), sizeof(id));
+		if (binformats.size() <= id)
+			binformats.resize(id + 1);
+		if (!binformats[id])
+			binformats[id] = findBinlogFormat(id);
+		bintext.clear();
+		structformat_e const style = (structformat_e)LogsFactoryImpl::struct_format.load(std::memory_order_relaxed);
+		if (binformats[id] && formatBinlogRecord(*binformats[id], rec.bin.data(), rec.bin.size(), bintext, style)) {
+			if (output) {
+				BufferWriterWithModifers::do_write_string(sbuf, &bintext[0], bintext.size());
+				if (rotating)
+					rotateIfFull(bintext.size());
+			}
+			if (sinklist)
+				to_sinks(bintext.data(), bintext.size(), rec.level);
+		}
+	};
+	for (;;) {
+		unsigned int const delay = coalesceDelay();
+		logs_ready.wait_for([&] { return !logs.empty() || finish || delay != coalesceDelay() || drained.pending(); }, std::chrono::milliseconds(delay));
+		std::uint64_t const batchstart = steadyNanos();
+		batchcount = 0;
+		if (sinks)
+			sinks->refresh(sinkversion, sinklist);
+		for (;;) {
+			for (;;) {
+				if (OVERFLOW_DROP_OLDEST == overflow.load(std::memory_order_relaxed)) {
+					if (!logs.try_pop(copy_record))
+						break;
+					logs_room.notify_all();
+					write_record(current);
+				}
+				else if (!logs.try_pop(write_record))
+					break;
+				else
+					logs_room.notify_all(); // producers blocked on full queue
+				if (!allwrite && finish)
+					return;
+			}
+			if (!delay)
+				break;
+			queueExpired(); // lines which waited too long are written in this round too
+			if (logs.empty())
+				break;
+		}
+		report_dropped();
+		if (sbuf)
+			sbuf->pubsync(); // queue drained, flush before going to sleep
+		if (binsbuf)
+			binsbuf->pubsync();
+		if (sinklist && !sinklist->pool) { // workers flush their sinks
+			for (SinkRegistry::entry const& e : sinklist->entries)
+				e.sink->flush();
+		}
+		if (batchcount) {
+			batchrecords.add(batchcount);
+			batchns.add(steadyNanos() - batchstart);
 		}
-	} while ((!logs->empty() && allwrite) || !finish);
-	int dummy = 0;
+		drained.publish(logs.dequeued()); // producers may have dropped some of them
+		if (finish && (!allwrite || logs.empty()))
+			break;
+	}
 }
 
 std::streamsize NoModifiersWriter::write(wchar_t const* s, std::streamsize n)
+{
+	std::string& line = utf8LineForThread();
+	appendWideAsUTF8(line, s, (size_t)n);
+	do_write_string(sbuf, line.data(), line.size());
+	return n;
+}
+
+std::streamsize NoModifiersWriter::write(char const* s, std::streamsize n)
 {
 	return BufferWriterWithModifers::do_write_string(sbuf, s, n);
 }
 
-LoggerBuf::LoggerBuf(BufferWriterWithModifersPtr bufwriter, size_t bufsize)
+static std::uint64_t nextBufferId(void)
+{
+	static std::atomic<std::uint64_t> ids(0);
+	return ids.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+template<typename _Char>
+BasicLoggerBuf<_Char>::BasicLoggerBuf(BufferWriterWithModifersPtr bufwriter, size_t bufsize, size_t maxrecord)
 	: bufwriter(bufwriter)
-	, bufsize(bufsize)
-	, bufptr(new wchar_t[bufsize ? bufsize : 4096], std::default_delete<wchar_t[]>())
-	, pbeg(bufptr.get())
-	, pend(pbeg + bufsize)
+	, bufsize(bufsize ? bufsize : 4096)
+	, maxrecord(maxrecord > this->bufsize ? maxrecord : this->bufsize)
+	, id(nextBufferId())
+	, alive(std::make_shared<char>(0))
 {
-	setp(pbeg, pend - 1);
+	this->setp(0, 0); // every character comes to overflow or xsputn
 }
 
-int LoggerBuf::overflow(wchar_t c)
+template<typename _Char>
+ThreadPutArea<_Char>& BasicLoggerBuf<_Char>::putAreaForThread(void)
 {
-	if (!pptr())
-		setp(pbeg, pbeg);
-	int w = pptr() - pbase();
-	if (c != EOF) {
-		// We always leave space
-		*pptr() = c;
-		++w;
+	thread_local ThreadPutArea<_Char>* recent = nullptr; // usually the thread logs to one stream, so it's one compare
+	if (recent && id == recent->owner)
+		return *recent;
+	thread_local std::vector<std::unique_ptr<ThreadPutArea<_Char>>> mine; // writer can log and add one
+	for (std::unique_ptr<ThreadPutArea<_Char>> const& area : mine) {
+		if (id == area->owner)
+			return *(recent = area.get());
 	}
-	if (w == bufwriter->write(pbeg, w)) {
-		setp(pbeg, pend - 1);
-		return (-1 != c) ? c : 'x'; // return non-eof
+	// unfinished lines of destroyed buffers are dropped
+	mine.erase(std::remove_if(mine.begin(), mine.end(), [](std::unique_ptr<ThreadPutArea<_Char>> const& area) { return area->alive.expired(); }), mine.end());
+	mine.emplace_back(new ThreadPutArea<_Char>{ id, alive, std::vector<_Char>() });
+	mine.back()->chars.reserve(bufsize);
+	return *(recent = mine.back().get());
+}
+
+template<typename _Char>
+bool BasicLoggerBuf<_Char>::writeLine(ThreadPutArea<_Char>& area)
+{
+	std::streamsize const w = (std::streamsize)area.chars.size();
+	if (FlightRecorder::recording())
+		FlightRecorder::record(area.chars.data(), (size_t)w);
+	std::streamsize const written = logmanip::lineOutput() ? bufwriter->write(area.chars.data(), w) : w;
+	logmanip::endLine();
+	area.chars.clear();
+	if (area.chars.capacity() > 16 * bufsize) { // kept for next long records unless it is really big
+		std::vector<_Char>().swap(area.chars);
+		area.chars.reserve(bufsize);
 	}
-	else {
-		setp(0, 0);
-		return -1; // Indicate error.
+	return w == written;
+}
+
+template<typename _Char>
+typename BasicLoggerBuf<_Char>::int_type BasicLoggerBuf<_Char>::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return 0 == sync() ? traits_type::not_eof(c) : traits_type::eof();
+	ThreadPutArea<_Char>& area = putAreaForThread();
+	area.chars.push_back(traits_type::to_char_type(c));
+	if (area.chars.size() < maxrecord || writeLine(area))
+		return traits_type::not_eof(c);
+	return traits_type::eof(); // Indicate error.
+}
+
+template<typename _Char>
+std::streamsize BasicLoggerBuf<_Char>::xsputn(_Char const* s, std::streamsize n)
+{
+	ThreadPutArea<_Char>& area = putAreaForThread();
+	std::streamsize done = 0;
+	while (done < n) {
+		size_t const room = maxrecord - area.chars.size();
+		size_t const part = (size_t)(n - done) < room ? (size_t)(n - done) : room;
+		area.chars.insert(area.chars.end(), s + done, s + done + part); // grows for long record
+		done += (std::streamsize)part;
+		if (area.chars.size() == maxrecord && !writeLine(area))
+			return done;
 	}
+	return n;
 }
 
-int LoggerBuf::sync(void)
+template<typename _Char>
+int BasicLoggerBuf<_Char>::sync(void)
 {
-	if (pptr() && pptr() > pbase())
-		return overflow(-1);// Flush waiting output
+	ThreadPutArea<_Char>& area = putAreaForThread();
+	if (!area.chars.empty())
+		return writeLine(area) ? 0 : -1; // Flush waiting output
 	return (0);
 }
 
+template class BasicLoggerBuf<wchar_t>;
+template class BasicLoggerBuf<char>;
+
 LogsFactoryImpl::LogsFactoryImpl(void)
-	: locEnUTF8(std::locale(), ::new std::codecvt_utf8<wchar_t>)
-	, clog_orig_stdbuf(std::wclog.rdbuf(), &LogsFactoryImpl::nodeleter)
-	, clog_orig_writer(std::make_shared<QueueWriter>(clog_orig_stdbuf, std::function<void(void)>(), std::shared_ptr<size_t>()))
+	: clog_orig_stdbuf(std::wclog.rdbuf(), &LogsFactoryImpl::nodeleter)
+	, clog_orig_utf8buf(std::clog.rdbuf(), &LogsFactoryImpl::utf8nodeleter)
+	, sinks(std::make_shared<SinkRegistry>())
+	, output_maxlevel(LDUMP)
+	, clog_orig_writer(std::make_shared<QueueWriter>(clog_orig_utf8buf, OpenNextFileFn(), RotationSizePtr(), QueuePolicy(), BinBufPtr(), sinks))
 	, clog_orig_logbuf(std::make_shared<LoggerBuf>(clog_orig_writer))
-	, clog_file_bymax(std::make_shared<size_t>(-1))
+	, clog_orig_utf8logbuf(std::make_shared<Utf8LoggerBuf>(clog_orig_writer))
+	, clog_file_bymax(std::make_shared<std::atomic<size_t>>(size_t(-1)))
+	, clog_file_batching()
+	, queue_policy()
+	, retired_dropped(0)
 	, clog_file_writer()
 	, clog_file_logbuf()
-	, tlog_writer(std::make_shared<TargetDirectWriter>(clog_orig_writer, bind(&LogsFactoryImpl::getTlogStreambuf, this)))
+	, tlog_writer(std::make_shared<TargetDirectWriter>(clog_orig_writer, *this))
 	, tlog_logbuf(std::make_shared<LoggerBuf>(tlog_writer))
 	, tlog_ostream(std::make_shared<std::wostream>(tlog_logbuf.get()))
 {
 #ifdef _MSC_VER
 	DWORD dwErr = 0;
-	if (FALSE == SetConsoleOutputCP(CP_UTF8)) // important on windows
+	if (FALSE == SetConsoleOutputCP(CP_UTF8)) // terminal gets UTF-8 octets of both streams
 		dwErr = GetLastError();
 #endif
-
-	std::wcout.imbue(locEnUTF8);
-	std::wclog.imbue(locEnUTF8);
-	std::wcerr.imbue(locEnUTF8);
-	tlog_ostream->imbue(locEnUTF8);
-
 	std::wclog.rdbuf(clog_orig_logbuf.get());
-	setModifiers(modifiers);
+	std::clog.rdbuf(clog_orig_utf8logbuf.get());
+	setModifiers(std::list<LogModifierFn>());
+	updateTargets();
 }
 
 LogsFactoryImpl::~LogsFactoryImpl()
 {
+	binlog_target = nullptr;
+	clog_target = nullptr;
+	TargetReaders::synchronize(); // writers are destroyed with members
+	++tlog_generation; // new instance can get the same address
+	logmanip::setOutputLevels(LDUMP, -1);
     std::wclog.rdbuf(clog_orig_stdbuf.get());
+	std::clog.rdbuf(clog_orig_utf8buf.get());
+}
+
+std::atomic<unsigned int> TargetReaders::epoch(0);
+thread_sharded<std::atomic<unsigned int>> TargetReaders::readers[2];
+
+void TargetReaders::synchronize(void)
+{
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	unsigned int const old = epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+	readers[old].forEach([](std::atomic<unsigned int> const& count) {
+		while (count.load(std::memory_order_seq_cst))
+			this_thread::yield();
+	});
+}
+
+std::atomic<QueueWriter*> LogsFactoryImpl::binlog_target(nullptr);
+std::atomic<QueueWriter*> LogsFactoryImpl::clog_target(nullptr);
+std::atomic<int> LogsFactoryImpl::struct_format(STRUCTFORMAT_LOGFMT);
+
+void LogsFactoryImpl::updateTargets(void)
+{
+	if (binlog_writer)
+		binlog_target = binlog_writer.get();
+	else if (clog_file_writer)
+		binlog_target = clog_file_writer.get();
+	else
+		binlog_target = clog_orig_writer.get();
+	clog_target = clog_file_writer ? clog_file_writer.get() : clog_orig_writer.get();
+	TargetReaders::synchronize();
+}
+
+void LogsFactoryImpl::setQueuePolicy(QueuePolicy const& policy)
+{
+	queue_policy = policy;
+	for (QueueWriterPtr const& writer : { clog_orig_writer, clog_file_writer, binlog_writer }) {
+		if (writer)
+			writer->setPolicy(policy);
+	}
+}
+
+void LogsFactoryImpl::setBackendPolicy(BackendPolicy const& policy)
+{
+	sinks->setWorkers(policy.sinkworkers);
+	BackendThreads::setPolicy(policy.cpus, policy.priority);
+}
+
+void LogsFactoryImpl::flush(void)
+{
+	for (QueueWriterPtr const& writer : { clog_orig_writer, clog_file_writer })
+		if (writer)
+			writer->flushCoalesced();
+}
+
+void LogsFactoryImpl::drain(void)
+{
+	for (QueueWriterPtr const& writer : { clog_orig_writer, clog_file_writer, binlog_writer })
+		if (writer)
+			writer->drain();
+	sinks->drain(); // backends have given lines to sink workers
+}
+
+unsigned long long LogsFactoryImpl::getDroppedRecords(void)
+{
+	unsigned long long total = retired_dropped;
+	for (QueueWriterPtr const& writer : { clog_orig_writer, clog_file_writer, binlog_writer }) {
+		if (writer)
+			total += writer->getDropped();
+	}
+	return total;
+}
+
+std::vector<LogWriterStats> LogsFactoryImpl::getStats(void)
+{
+	std::vector<LogWriterStats> all;
+	std::pair<char const*, QueueWriterPtr> const writers[] = {
+		{ "terminal", clog_orig_writer }, { "clog file", clog_file_writer }, { "binlog", binlog_writer },
+	};
+	for (auto const& writer : writers) {
+		if (!writer.second)
+			continue;
+		all.emplace_back();
+		all.back().name = writer.first;
+		writer.second->getStats(all.back());
+	}
+	return all;
 }
 
 void LogsFactoryImpl::setModifiers(std::list<LogModifierFn> const& m)
 {
-	modifiers = m;
-#if 0
-	modifiers.push_back(logmod_date);
-	modifiers.push_back(logmod_time);
-#endif
-	modifiers.push_back(logmanip::getLogModifierIndentation()); // indentation modifer is always active
-	modifiers.push_back(logmanip::getLogModifierThreadname());
+	setLayout(PrefixLayout::fromModifiers(m));
+}
+
+void LogsFactoryImpl::setPrefixLayout(std::wstring const& pattern)
+{
+	setLayout(PrefixLayout::compile(pattern));
+}
+
+void LogsFactoryImpl::setLayout(PrefixLayoutPtr newlayout)
+{
+	layout = newlayout;
 	if (clog_orig_writer)
-		clog_orig_writer->setModifiers(modifiers);
+		clog_orig_writer->setLayout(layout);
 	if (clog_file_writer)
-		clog_file_writer->setModifiers(modifiers);
+		clog_file_writer->setLayout(layout);
 	if (tlog_writer)
-		tlog_writer->setModifiers(modifiers);
+		tlog_writer->setLayout(layout);
+}
+
+/// Wide name is given to filebuf where it has such open, otherwise it's converted to UTF-8
+static std::filebuf* openFilebuf(std::filebuf& fb, std::wstring const& filename, std::ios::openmode mode)
+{
+#ifdef _WIN32
+	return fb.open(filename.c_str(), mode);
+#else
+	std::string utf8name;
+	appendWideAsUTF8(utf8name, filename.data(), filename.size());
+	return fb.open(utf8name.c_str(), mode);
+#endif
 }
 
 inline bool fileExists(std::wstring const& fname)
 {
-	return nullptr != std::wfilebuf().open(fname.c_str(), std::ios::in);
+	std::filebuf fb;
+	return nullptr != openFilebuf(fb, fname, std::ios::in);
 }
 
 void LogsFactoryImpl::setClogOutput(std::wstring const fnamebase)
 {
-    if(fnamebase.empty()) {
+	if (fnamebase.empty()) {
+		QueueWriterPtr const retired(clog_file_writer); // kept until updateTargets returns
 		std::wclog.rdbuf(clog_orig_logbuf.get());
+		std::clog.rdbuf(clog_orig_utf8logbuf.get());
+		retired_dropped += clog_file_writer ? clog_file_writer->getDropped() : 0;
 		clog_file_writer.reset();
 		clog_file_logbuf.reset();
+		clog_file_utf8logbuf.reset();
+		updateTargets();
 		return;
-    }
+	}
+	FileSinkBufPtr fb(openClogFile(fnamebase, clog_file_batching));
+	if (!fb)
+		return;
+	retired_dropped += clog_file_writer ? clog_file_writer->getDropped() : 0;
 	prev_clog_file_writer = clog_file_writer; // ensure lifetime until clog.rdbuf
 	prev_clog_file_logbuf = clog_file_logbuf; // ensure lifetime until clog.rdbuf
+	prev_clog_file_utf8logbuf = clog_file_utf8logbuf;
+
+	OpenNextFileFn opennext = bind(&LogsFactoryImpl::openClogFile, fnamebase, clog_file_batching);
+	clog_file_writer.reset(new QueueWriter(fb, opennext, clog_file_bymax, queue_policy, BinBufPtr(), sinks));
+	clog_file_logbuf = std::make_shared<LoggerBuf>(clog_file_writer);
+	clog_file_utf8logbuf = std::make_shared<Utf8LoggerBuf>(clog_file_writer);
+	clog_file_writer->setLayout(layout);
+	std::wclog.rdbuf(clog_file_logbuf.get()); // redirect clog to file through queued buffer
+	std::clog.rdbuf(clog_file_utf8logbuf.get());
+	updateTargets();
+}
 
+FileSinkBufPtr LogsFactoryImpl::openClogFile(std::wstring const& fnamebase, FileBatching const& batching)
+{
 	//ako vec postoji bekapuj (koristi time of day za filename sufiks)
 	std::wstring fname = fnamebase + L"-" + getDateTimeFilenameSuffix();
 	while (fileExists(fname)) {
 		fname.push_back('0');
 	}
-	std::shared_ptr<std::wfilebuf> fb(new std::wfilebuf);
-	fb->open(fname.c_str(), std::ios::out | std::ios::trunc);
+	std::shared_ptr<FileSinkBuf> fb(new FileSinkBuf(batching)); // UTF-8 octets are written without codecvt
+	fb->open(fname);
     if(!fb->is_open()) {
-        std::wcerr << "Can't open " << fname << " for clog backend" << std::endl;
-        return;
+        Utf8Log(std::cerr) << "Can't open " << fname << " for clog backend" << std::endl;
+        return FileSinkBufPtr();
     }
-	std::function<void(void)> rotate_fn = bind(&LogsFactoryImpl::setClogOutput, this, fnamebase);
-	clog_file_writer.reset(new QueueWriter(fb, rotate_fn, clog_file_bymax));
-	clog_file_logbuf = std::make_shared<LoggerBuf>(clog_file_writer);
-    if(!clog_file_writer || !clog_file_logbuf) {
-        std::wcerr << "Can't create clog backend" << std::endl;
-        return;
-    }
-	clog_file_writer->setModifiers(modifiers);
-    std::wclog.rdbuf(clog_file_logbuf.get()); // redirect clog to file through queued buffer
+	return fb;
+}
+
+SinkRegistry::ListPtr SinkRegistry::publish(std::shared_ptr<list_type> changed)
+{
+	for (entry& e : changed->entries) { // the same sink stays on the same worker while their number doesn't change
+		size_t const wanted = e.wanted < 0 ? std::hash<std::string>()(e.name) : (size_t)e.wanted;
+		e.worker = changed->pool ? wanted % changed->pool->size() : 0;
+	}
+	ListPtr previous(list);
+	list = changed;
+	version.fetch_add(1, std::memory_order_release);
+	return previous;
+}
+
+void SinkRegistry::set(std::string const& name, LogSinkPtr sink, loglevel_e maxlevel, int worker)
+{
+	if (!sink)
+		return remove(name);
+	ListPtr retired; // released after unlock
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<list_type> changed(std::make_shared<list_type>(*list));
+	auto it = std::find_if(changed->entries.begin(), changed->entries.end(), [&](entry const& e) { return e.name == name; });
+	if (it == changed->entries.end())
+		changed->entries.push_back(entry{ name, sink, maxlevel, worker, 0 });
+	else
+		*it = entry{ name, sink, maxlevel, worker, 0 };
+	retired = publish(changed);
+}
+
+void SinkRegistry::remove(std::string const& name)
+{
+	ListPtr retired; // released after unlock
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<list_type> changed(std::make_shared<list_type>(*list));
+	changed->entries.erase(std::remove_if(changed->entries.begin(), changed->entries.end(), [&](entry const& e) { return e.name == name; }), changed->entries.end());
+	retired = publish(changed);
+}
+
+int SinkRegistry::maxLevel(void) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	int level = -1;
+	for (entry const& e : list->entries)
+		level = e.maxlevel > level ? e.maxlevel : level;
+	return level;
+}
+
+void SinkRegistry::setWorkers(size_t workers)
+{
+	ListPtr retired; // old pool joins its workers after unlock, unless a backend still uses it
+	std::lock_guard<std::mutex> lock(mutex);
+	if (workers == (list->pool ? list->pool->size() : 0))
+		return;
+	std::shared_ptr<list_type> changed(std::make_shared<list_type>(*list));
+	changed->pool = workers ? std::make_shared<SinkPool>(workers) : SinkPoolPtr();
+	retired = publish(changed);
+}
+
+void SinkRegistry::refresh(unsigned int& seen, ListPtr& current) const
+{
+	if (current && seen == version.load(std::memory_order_acquire))
+		return;
+	ListPtr retired; // backend can be the last user of replaced pool, it's released after unlock
+	std::lock_guard<std::mutex> lock(mutex);
+	seen = version.load(std::memory_order_relaxed);
+	retired.swap(current);
+	current = list->entries.empty() ? ListPtr() : list; // no list when there is no sink, backend checks only pointer
+}
+
+void SinkRegistry::drain(void) const
+{
+	SinkPoolPtr pool;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pool = list->pool;
+	}
+	if (pool)
+		pool->drain();
+}
+
+LogRingSink::LogRingSink(size_t maxlines)
+	: ring(maxlines ? maxlines : 1)
+	, next(0)
+	, used(0)
+{ }
+
+void LogRingSink::write(char const* line, size_t n, loglevel_e /*lvl*/)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ring[next].assign(line, n);
+	next = (next + 1) % ring.size();
+	if (used < ring.size())
+		++used;
+}
+
+std::vector<std::string> LogRingSink::lines(void) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<std::string> all;
+	all.reserve(used);
+	for (size_t i = 0; i < used; ++i)
+		all.push_back(ring[(next + ring.size() - used + i) % ring.size()]);
+	return all;
+}
+
+/// Lines are written to streambuf as they are \see createStreambufSink, createFileSink
+class StreambufSink : public LogSink {
+public:
+	StreambufSink(std::streambuf* sbuf, Utf8BufPtr owned = Utf8BufPtr())
+		: sbuf(sbuf)
+		, owned(owned)
+	{ }
+	void write(char const* line, size_t n, loglevel_e /*lvl*/)
+	{
+		sbuf->sputn(line, (std::streamsize)n);
+	}
+	void flush(void)
+	{
+		sbuf->pubsync();
+	}
+private:
+	std::streambuf* const sbuf;
+	Utf8BufPtr const      owned;
+};
+
+LogSinkPtr createStreambufSink(std::streambuf* sbuf)
+{
+	return sbuf ? std::make_shared<StreambufSink>(sbuf) : LogSinkPtr();
+}
+
+LogSinkPtr createFileSink(std::wstring const& filename, FileBatching const& batching)
+{
+	std::shared_ptr<FileSinkBuf> fb(new FileSinkBuf(batching));
+	if (!fb->open(filename)) {
+		Utf8Log(std::cerr) << "Can't open " << filename << " for log sink" << std::endl;
+		return LogSinkPtr();
+	}
+	return std::make_shared<StreambufSink>(fb.get(), fb);
+}
+
+void LogsFactoryImpl::setBinlogOutput(std::wstring const& filename)
+{
+	if (filename.empty()) {
+		QueueWriterPtr const retired(binlog_writer); // kept until updateTargets returns
+		retired_dropped += binlog_writer ? binlog_writer->getDropped() : 0;
+		binlog_writer.reset();
+		updateTargets();
+		return;
+	}
+	std::shared_ptr<std::filebuf> fb(new std::filebuf);
+	openFilebuf(*fb, filename, std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!fb->is_open()) {
+		Utf8Log(std::cerr) << "Can't open " << filename << " for binary log" << std::endl;
+		return;
+	}
+	writeBinlogHeader(*fb);
+	QueueWriterPtr const retired(binlog_writer);
+	retired_dropped += binlog_writer ? binlog_writer->getDropped() : 0;
+	binlog_writer.reset(new QueueWriter(Utf8BufPtr(), OpenNextFileFn(), RotationSizePtr(), queue_policy, fb));
+	updateTargets();
 }
 
 void LogsFactoryImpl::setTlogOutputImpl(std::wstring const& filename)
 {
 	if(filename.empty()) {
-        tlog_stdbuf.reset();//everything goes to std::wclog from this thread
+		tlog_file.reset();//everything goes to std::wclog from this thread
 		// ako je u std::wclog svakako se vec koristi clog_orig_buf
-        return;
-    }
-    std::shared_ptr<std::wfilebuf> fb(new std::wfilebuf);
-    assert(fb.get());
-	fb->open(filename.c_str(), std::ios::out | std::ios::trunc);
-    if(!fb->is_open()) {
-        std::wcerr << "Can't open " << filename << " for thread log" << std::endl;
-        return;
-    }
-    //thread stream with initialized backend of type boostsbuf_t
-	tlog_stdbuf.reset(new StdBufPtr(fb));
-    if(!tlog_stdbuf.get()) {
-        std::wcerr << "Can't create thread log output stream" << std::endl;
-        return;
-    }
+		tlog_sbuf = nullptr;
+		return;
+	}
+	std::shared_ptr<std::filebuf> fb(new std::filebuf);
+	assert(fb.get());
+	openFilebuf(*fb, filename, std::ios::out | std::ios::trunc);
+	if(!fb->is_open()) {
+		Utf8Log(std::cerr) << "Can't open " << filename << " for thread log" << std::endl;
+		return;
+	}
+	tlog_file = fb;
+	tlog_sbuf = fb.get();
 }
 
-StdBufPtr LogsFactoryImpl::getTlogStreambuf(void)
+std::streambuf* LogsFactoryImpl::resolveTlogStreambuf(void)
 {
-	if (!tlogfile_name_prefix.empty())
-	{
-		if (!tlog_stdbuf.get()) {
+	unsigned int const generation = tlog_generation.load(std::memory_order_acquire);
+	if (tlog_owner != this) { // file of other (or destroyed) instance
+		tlog_file.reset();
+		tlog_sbuf = nullptr;
+		tlog_owner = this;
+	}
+	if (!tlogfile_name_prefix.empty()) {
+		if (!tlog_file) { // failed open isn't repeated until the next change of prefix
 			std::wostringstream oss;
 			oss << this_thread::get_id();
 			setTlogOutputImpl(tlogfile_name_prefix + oss.str());
 		}
-		if (tlog_stdbuf.get())
-			return *tlog_stdbuf.get();
-		// fallback to std::wclog
 	}
-	else {
-		if (tlog_stdbuf.get())
-			setTlogOutputImpl(std::wstring());
-	}
-	return StdBufPtr();
+	else if (tlog_file)
+		setTlogOutputImpl(std::wstring());
+	tlog_resolved = generation;
+	return tlog_sbuf;
 }
 
 LogsFactoryBase::LogsFactoryBase(void)
@@ -492,6 +1621,56 @@ void LogsFactoryBase::setClogRotationSize(size_t bymax)
 	_impl->setClogRotationSize(bymax);
 }
 
+void LogsFactoryBase::setClogFileBatching(FileBatching const& batching)
+{
+	_impl->setClogFileBatching(batching);
+}
+
+void LogsFactoryBase::setQueuePolicy(QueuePolicy const& policy)
+{
+	_impl->setQueuePolicy(policy);
+}
+
+void LogsFactoryBase::flush(void)
+{
+	_impl->flush();
+}
+
+void LogsFactoryBase::drain(void)
+{
+	_impl->drain();
+}
+
+unsigned long long LogsFactoryBase::getDroppedRecords(void)
+{
+	return _impl->getDroppedRecords();
+}
+
+std::vector<LogWriterStats> LogsFactoryBase::getStats(void)
+{
+	return _impl->getStats();
+}
+
+void LogsFactoryBase::setOutputLevel(loglevel_e maxlevel)
+{
+	_impl->setOutputLevel(maxlevel);
+}
+
+void LogsFactoryBase::setSink(std::string const& name, LogSinkPtr sink, loglevel_e maxlevel, int worker)
+{
+	_impl->setSink(name, sink, maxlevel, worker);
+}
+
+void LogsFactoryBase::removeSink(std::string const& name)
+{
+	_impl->removeSink(name);
+}
+
+void LogsFactoryBase::setBackendPolicy(BackendPolicy const& policy)
+{
+	_impl->setBackendPolicy(policy);
+}
+
 /** Postavlja zadani fajl kao izlaz. \todo za filename.empty treba se koristiti terminal kao
 izlaz ali indirektno preko clog_orig_buf */
 void LogsFactoryBase::setClogOutput(std::wstring const& filename) 
@@ -505,6 +1684,16 @@ void LogsFactoryBase::setTlogOutputPrefix(std::wstring const& filename_prefix)
 	_impl->setTlogOutputPrefix(filename_prefix); 
 }
 
+void LogsFactoryBase::setBinlogOutput(std::wstring const& filename)
+{
+	_impl->setBinlogOutput(filename);
+}
+
+void LogsFactoryBase::setStructuredFormat(structformat_e format)
+{
+	LogsFactoryImpl::struct_format.store(format, std::memory_order_relaxed);
+}
+
 std::wostream& LogsFactoryBase::getTlogOutput(void) 
 { 
 	return _impl->getTlogOutput(); 
@@ -515,6 +1704,11 @@ void LogsFactoryBase::setModifiers(std::list<LogModifierFn> modifiers)
 	return _impl->setModifiers(modifiers); 
 }
 
+void LogsFactoryBase::setPrefixLayout(std::wstring const& pattern)
+{
+	return _impl->setPrefixLayout(pattern);
+}
+
 tlog_tag  tlog;
 
 std::string srcpos_full(unsigned int line, std::string const& function, std::string const& file)
@@ -534,9 +1728,30 @@ std::string srcpos_short(unsigned int line, std::string const& function, std::st
 	return srcpos_full(line, function, file.substr(file.rfind(PATH_SLASH_CHARACTER) + 1));
 }
 
+Tracer::Tracer(SourceSite const* site)
+	: site(site)
+{
+	LVLTLOG(LTRACE, "Enter " << site);
+}
+
+Tracer::~Tracer()
+{
+	LVLTLOG(LTRACE, "Leave " << site);
+}
+
+Utf8Log& Utf8Log::write(wchar_t const* s, size_t n)
+{
+	thread_local std::string utf8;
+	utf8.clear();
+	appendWideAsUTF8(utf8, s, n);
+	os.write(utf8.data(), utf8.size());
+	return *this;
+}
+
 void EnableLogMessages(bool bEnable)
 {
 	std::wclog.setstate(bEnable ? std::ios_base::goodbit : std::ios_base::failbit);
+	std::clog.setstate(bEnable ? std::ios_base::goodbit : std::ios_base::failbit);
 }
 
 }
@@ -1,29 +1,58 @@
 ﻿#pragma once
 #include "bmu/Logger.h"
 #include "bmu/thread_types.hxx"
+#include "bmu/mpsc_queue.hxx"
+#include <ctime>
+#include <chrono>
+#include <vector>
 
 namespace beam_me_up {
 
+#ifndef _countof // MSVC has it in stdlib.h
+template<typename _T, size_t _N>
+constexpr size_t _countof(_T const (&)[_N])
+{
+	return _N;
+}
+#endif
+
 typedef std::shared_ptr<std::wostream> OstreamPtr;
+typedef std::shared_ptr<std::streambuf> BinBufPtr;
+/// Text sink, lines are written to it as UTF-8 octets without any conversion
+typedef std::shared_ptr<std::streambuf> Utf8BufPtr;
+
+void to_localtime_thread_safe(std::time_t const& time, std::tm& tm_snapshot);
+
+class StagingBuf;
+class PrefixLayout;
+typedef std::shared_ptr<PrefixLayout const> PrefixLayoutPtr;
 
 /// Pisanje u stringa u izlazni bafer uzimajući u obzir pridružene modifikatori od kojih se dobijaju
 /// vrijednosti za ispisivanje prije svakog reda.
 class BufferWriterWithModifers {
 protected:
 	BufferWriterWithModifers(void)
+		: layout(nullptr)
 	{ }
 public:
 	virtual ~BufferWriterWithModifers()
 	{ }
-	/// Dodavanje modifikatora koji se uzimaju u obzir pri pisanju u bafer
-	void setModifiers(std::list<LogModifierFn> newmodifers);
+	/// Layout of prefix which is rendered before every line, lines being written can still use the previous one
+	void setLayout(PrefixLayoutPtr newlayout);
 	virtual std::streamsize write(wchar_t const* s, std::streamsize n) = 0;
+	/// Line from UTF-8 log stream, written without conversion
+	virtual std::streamsize write(char const* s, std::streamsize n) = 0;
 protected:
-	/// Ispisivanje jednog reda u bafer iz vrijednosti dobijenih od pridruženih modifikatora.
-	void do_write_modifiers(StdBufPtr sbuf);
-	std::streamsize do_write_string(StdBufPtr sbuf, wchar_t const* s, std::streamsize n);
+	/// Prefix rendered into thread's staging buffer
+	StagingBuf& do_render_modifiers(void);
+	/// Prefix and the line as UTF-8 in per-thread buffer, wide line is converted
+	std::string const& do_format_line(wchar_t const* s, std::streamsize n);
+	std::string const& do_format_line(char const* s, std::streamsize n);
+	std::streamsize do_write_string(Utf8BufPtr sbuf, char const* s, std::streamsize n);
 private:
-	std::list<LogModifierFn>    modifiers;
+	std::atomic<PrefixLayout const*> layout;
+	std::mutex                       layoutslock;
+	PrefixLayoutPtr                  owned; // layout, the previous one is released after TargetReaders::synchronize
 };
 
 typedef std::shared_ptr<BufferWriterWithModifers> BufferWriterWithModifersPtr;
@@ -31,60 +60,549 @@ typedef std::shared_ptr<BufferWriterWithModifers> BufferWriterWithModifersPtr;
 /// no synchronization as appropriate for per-thread ostream /see GetTlogOutput
 class DirectWriter : public BufferWriterWithModifers {
 public:
-	DirectWriter(StdBufPtr sbuf)
+	DirectWriter(Utf8BufPtr sbuf)
 		: sbuf(sbuf)
 	{ }
 	std::streamsize write(wchar_t const* s, std::streamsize n);
+	std::streamsize write(char const* s, std::streamsize n);
 private:
-	StdBufPtr sbuf;
+	Utf8BufPtr sbuf;
 };
 
 typedef std::shared_ptr<DirectWriter> DirectWriterPtr;
 
-typedef std::function<StdBufPtr(void)> TargetStreambufGetterFn;
+class LogsFactoryImpl;
 
 /// no synchronization as appropriate for per-thread ostream /see GetTlogOutput
+/// Per-thread file is taken from factory \see LogsFactoryImpl::getTlogStreambuf, fallback writes lines of
+/// threads without it.
 class TargetDirectWriter : public BufferWriterWithModifers {
 	explicit TargetDirectWriter(void) = delete;
 public:
-	TargetDirectWriter(BufferWriterWithModifersPtr fallback, TargetStreambufGetterFn getsbuf)
+	TargetDirectWriter(BufferWriterWithModifersPtr fallback, LogsFactoryImpl& factory)
 		: fallback(fallback)
-		, getsbuf(getsbuf)
+		, factory(factory)
 	{ }
 	std::streamsize write(wchar_t const* s, std::streamsize n);
+	std::streamsize write(char const* s, std::streamsize n);
 private:
 	BufferWriterWithModifersPtr fallback;
-	TargetStreambufGetterFn     getsbuf;
+	LogsFactoryImpl&            factory;
 };
 
 typedef std::shared_ptr<TargetDirectWriter> TargetDirectWriterPtr;
 
-typedef std::function<void(void)> RotateFileFn;
+class FileSinkBuf;
+typedef std::shared_ptr<FileSinkBuf> FileSinkBufPtr;
+/// Opens file which will take over after rotation, null if it can't be opened
+typedef std::function<FileSinkBufPtr(void)> OpenNextFileFn;
+/// Rotation size shared with writers, can be changed while they write
+typedef std::shared_ptr<std::atomic<size_t>> RotationSizePtr;
+
+/// Writes all octets to file descriptor, repeats after partial writes and interrupts. Only
+/// async-signal-safe calls are used.
+bool writeAll(int fd, char const* s, size_t n);
+
+/// File opened as plain descriptor, backend's lines are copied into one buffer which is written
+/// with single write (or writev together with line which doesn't fit) \see FileBatching
+class FileSinkBuf : public std::streambuf {
+	FileSinkBuf(FileSinkBuf const&) = delete;
+	void operator = (FileSinkBuf const&) = delete;
+public:
+	explicit FileSinkBuf(FileBatching const& batching);
+	~FileSinkBuf();
+	bool open(std::wstring const& filename);
+	bool is_open(void) const
+	{
+		return fd >= 0;
+	}
+	/// Closes and removes the file (and its index) if nothing was written to it, e.g. the next file of
+	/// rotation which was opened ahead
+	void removeIfUnused(void);
+protected:
+	int_type overflow(int_type c);
+	std::streamsize xsputn(char const* s, std::streamsize n);
+	/// Backend has written all queued lines
+	int sync(void);
+private:
+	bool flushBatch(char const* extra, size_t extralen);
+	void dataSync(void);
+	void addIndexEntry(void);
+	int                                   fd;
+	std::wstring                          filename;
+	std::vector<char>                     buf;
+	std::chrono::milliseconds const       maxdelay;
+	std::chrono::steady_clock::time_point first; // when the oldest buffered line came
+	datasync_e const                      datasync;
+	bool                                  unsynced;
+	int                                   idxfd; // sidecar index, -1 without it
+	size_t const                          indexrecords;
+	size_t const                          indexbytes;
+	std::string                           idxpending; // entries written after their batch
+	unsigned long long                    offset; // of the next record in the file
+	unsigned long long                    indexedoffset; // of the last index entry
+	size_t                                indexedrecords; // since the last index entry
+	long long                             indexedns; // time of the last index entry, -1 before the first
+};
+
+/// Per-thread buffer in which modifiers render line prefix. It's reused for every line so
+/// after first few lines it has enough capacity and rendering doesn't allocate.
+class StagingBuf : public std::wstreambuf {
+	StagingBuf(StagingBuf const&) = delete;
+	void operator = (StagingBuf const&) = delete;
+public:
+	StagingBuf(void)
+		: buf(256, L'\0')
+	{
+		setp(&buf[0], &buf[0] + buf.size());
+	}
+	void clear(void)
+	{
+		setp(&buf[0], &buf[0] + buf.size());
+	}
+	wchar_t const* data(void) const
+	{
+		return pbase();
+	}
+	size_t size(void) const
+	{
+		return pptr() - pbase();
+	}
+	/// The same as sputn but without virtual call when it has to grow
+	void append(wchar_t const* s, size_t n)
+	{
+		if ((size_t)(epptr() - pptr()) < n)
+			grow(n);
+		traits_type::copy(pptr(), s, n);
+		pbump((int)n);
+	}
+	/// Thread's own instance, shared pointer is created only once per thread
+	static StagingBuf& forThread(StdBufPtr& asptr);
+protected:
+	int_type overflow(int_type c);
+	std::streamsize xsputn(wchar_t const* s, std::streamsize n);
+private:
+	void grow(size_t atleast);
+	std::wstring buf;
+};
+
+/// Line prefix compiled from pattern (\see LogsFactoryBase::setPrefixLayout) or from list of
+/// modifiers into flat list of fields. Fields are rendered in one switch, per-thread values like
+/// thread id are formatted once, only custom modifiers are called through std::function.
+class PrefixLayout {
+public:
+	/// Unknown % sequences are copied as text
+	static PrefixLayoutPtr compile(std::wstring const& pattern);
+	/// Library modifiers become fields, indentation and thread name are added at the end
+	static PrefixLayoutPtr fromModifiers(std::list<LogModifierFn> const& modifiers);
+	/// Appends prefix of the current line, asptr is the same buffer for custom modifiers
+	void render(StagingBuf& out, StdBufPtr const& asptr) const;
+private:
+	enum field_e {
+		field_text,
+		field_date,
+		field_time,
+		field_usec,
+		field_datetime,
+		field_threadid,
+		field_threadname,
+		field_indent,
+		field_modifier,
+	};
+	struct field {
+		field_e type;
+		size_t  index; // first character in text or index of modifier
+		size_t  len;
+	};
+	PrefixLayout(void)
+		: clock(false)
+	{ }
+	void add(field_e type);
+	void addText(wchar_t const* s, size_t n);
+	std::vector<field>         fields;
+	std::wstring               text; // literal parts of pattern
+	std::vector<LogModifierFn> modifiers;
+	bool                       clock; // some field needs current time
+};
+
+struct BinlogFormat;
+/// Starts binary log file
+void writeBinlogHeader(std::streambuf& out);
+/// Writes deferred record to binary log, before first record with some id its format descriptor is written
+void writeBinlogEntry(std::streambuf& out, std::vector<bool>& defined, char const* rec, size_t n);
+
+/// One queued line. Text is already formatted UTF-8, binary is deferred record formatted by backend \see BinLog.h
+struct LogRecord {
+	std::string   text;
+	std::string   bin;
+	std::uint64_t enqueuedns; // steady clock, for latency statistics
+	loglevel_e    level; // for sinks
+	bool          output; // for primary outputs too, decided when it's queued \see logmanip::isPrimaryOutput
+	bool          coalesced; // text has several lines of one level \see CoalescedLines
+};
+
+/// Affinity and priority of backend threads \see BackendPolicy. Settings are applied to every thread
+/// between enter and leave, also when they change.
+class BackendThreads {
+public:
+	static void setPolicy(std::vector<int> const& cpus, int priority);
+	/// Current thread is backend thread, called by the thread itself
+	static void enter(void);
+	static void leave(void);
+};
+
+struct BackendThreadScope {
+	BackendThreadScope(void)
+	{
+		BackendThreads::enter();
+	}
+	~BackendThreadScope()
+	{
+		BackendThreads::leave();
+	}
+};
+
+/// Position of queue up to which consumer has written everything \see LogsFactoryBase::drain. Consumer
+/// publishes it after every round, threads which wait for their ticket sleep until it gets there.
+class DrainMark {
+	DrainMark(DrainMark const&) = delete;
+	void operator = (DrainMark const&) = delete;
+public:
+	DrainMark(void)
+		: written(0)
+		, requested(0)
+		, waiters(0)
+	{ }
+	/// Consumer, everything it dequeued until pos is written and flushed
+	void publish(size_t pos)
+	{
+		written.store(pos, std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_seq_cst)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_all();
+		}
+	}
+	/// Some thread waits for position which isn't published yet, consumer shouldn't sleep
+	bool pending(void) const
+	{
+		return before(written.load(std::memory_order_acquire), requested.load(std::memory_order_acquire));
+	}
+	/// Waits until ticket is published, wake() is called once consumer can see the request
+	template<typename _Fn>
+	void wait(size_t ticket, _Fn&& wake)
+	{
+		size_t wanted = requested.load(std::memory_order_relaxed);
+		while (before(wanted, ticket) && !requested.compare_exchange_weak(wanted, ticket, std::memory_order_seq_cst))
+			;
+		wake();
+		std::unique_lock<std::mutex> lock(mutex);
+		waiters.fetch_add(1, std::memory_order_seq_cst);
+		cond.wait(lock, [&] { return !before(written.load(std::memory_order_seq_cst), ticket); });
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+private:
+	static bool before(size_t a, size_t b)
+	{
+		return (std::intptr_t)(a - b) < 0; // positions wrap
+	}
+	std::atomic<size_t>     written;
+	std::atomic<size_t>     requested; // the furthest ticket
+	std::atomic<int>        waiters;
+	std::mutex              mutex;
+	std::condition_variable cond;
+};
+
+/// Line queued for sink worker
+struct SinkLine {
+	std::string line;
+	LogSinkPtr  sink;
+	loglevel_e  level;
+};
+
+/// Sink workers \see BackendPolicy::sinkworkers. Writer backends queue lines, every worker writes
+/// and flushes its sinks. Destructor waits until workers write what they have.
+class SinkPool {
+	SinkPool(SinkPool const&) = delete;
+	void operator = (SinkPool const&) = delete;
+	struct worker {
+		explicit worker(size_t capacity)
+			: lines(capacity)
+		{ }
+		bounded_mpsc_queue<SinkLine> lines;
+		event_notifier               lines_ready;
+		event_notifier               lines_room; // worker popped, backends of full queue retry
+		DrainMark                    drained;
+		thread_type                  thread;
+	};
+public:
+	explicit SinkPool(size_t workers, size_t capacity = 8192);
+	~SinkPool();
+	size_t size(void) const
+	{
+		return workers.size();
+	}
+	/// Waits if the worker's queue is full
+	void write(size_t worker, LogSinkPtr const& sink, char const* line, size_t n, loglevel_e lvl);
+	/// Waits until workers write and flush lines queued before the call
+	void drain(void);
+private:
+	void run(worker& w);
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<bool>                    finish;
+};
+
+typedef std::shared_ptr<SinkPool> SinkPoolPtr;
+
+/// Sinks of clog writers \see LogsFactoryBase::setSink. List is replaced on every change so backend
+/// takes it under lock only when version differs from the one it has.
+class SinkRegistry {
+public:
+	struct entry {
+		std::string name;
+		LogSinkPtr  sink;
+		loglevel_e  maxlevel;
+		int         wanted; // worker given to setSink
+		size_t      worker; // index in pool
+	};
+	/// Sinks with pool which writes them, pool is null when backends write sinks themselves
+	struct list_type {
+		std::vector<entry> entries;
+		SinkPoolPtr        pool;
+	};
+	typedef std::shared_ptr<list_type const> ListPtr;
+	SinkRegistry(void)
+		: list(std::make_shared<list_type>())
+		, version(0)
+	{ }
+	void set(std::string const& name, LogSinkPtr sink, loglevel_e maxlevel, int worker);
+	void remove(std::string const& name);
+	/// The most verbose maxlevel of sinks, -1 without sinks
+	int maxLevel(void) const;
+	/// New pool for workers > 0, the old one is destroyed when backends stop using it
+	void setWorkers(size_t workers);
+	/// Called by backend, list is replaced if it was changed since version
+	void refresh(unsigned int& seen, ListPtr& current) const;
+	/// Waits for sink workers \see SinkPool::drain
+	void drain(void) const;
+private:
+	/// Replaces list, caller holds mutex. Previous list is released after unlock, it can be the last
+	/// owner of replaced pool whose destructor joins workers which may be in sinks calling the registry.
+	ListPtr publish(std::shared_ptr<list_type> changed);
+	mutable std::mutex    mutex;
+	ListPtr               list;
+	std::atomic<unsigned> version;
+};
+
+typedef std::shared_ptr<SinkRegistry> SinkRegistryPtr;
+
+class QueueWriter;
+
+/// Per-thread rings of recent lines and their dump on fatal signal \see installFlightRecorder
+class FlightRecorder {
+public:
+	static bool recording(void)
+	{
+		return 0 != ringbytes.load(std::memory_order_relaxed);
+	}
+	/// Line from log stream of this thread, it's copied into thread's ring
+	static void record(char const* s, size_t n);
+	static void record(wchar_t const* s, size_t n);
+	/// Queues of registered writers are dumped too
+	static void addWriter(QueueWriter const* writer);
+	static void removeWriter(QueueWriter const* writer);
+	static bool install(std::wstring const& crashfile, loglevel_e level, size_t ringbytes);
+	static void uninstall(void);
+	/// Only async-signal-safe calls, sig is 0 when it's not called from handler
+	static void dump(int fd, int sig);
+private:
+	static void onFatalSignal(int sig);
+	static std::atomic<size_t> ringbytes; // 0 when not installed
+};
+
+/// Lines of one thread collected for one writer \see QueuePolicy::coalescebytes
+struct CoalescedLines {
+	std::mutex         lock; // thread takes it for every line, others only to queue the lines
+	std::string        text;
+	std::uint64_t      firstns; // when the oldest line came
+	loglevel_e         level; // of every line
+	bool               output; // every line is for primary outputs too \see LogRecord::output
+	QueueWriter const* writer;
+	std::atomic<bool>  closed; // writer is destroyed
+	bool               orphan; // thread ended, backend queues the rest and forgets it
+};
+
+typedef std::shared_ptr<CoalescedLines> CoalescedLinesPtr;
+
+/// Nanoseconds of steady clock
+inline std::uint64_t steadyNanos(void)
+{
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// LogHistogram updated with relaxed atomics, it's read only for statistics
+class AtomicHistogram {
+	AtomicHistogram(AtomicHistogram const&) = delete;
+	void operator = (AtomicHistogram const&) = delete;
+public:
+	AtomicHistogram(void);
+	void add(unsigned long long v);
+	/// Adds counts to h
+	void mergeInto(LogHistogram& h) const;
+private:
+	std::atomic<unsigned long long> counts[LogHistogram::buckets];
+	std::atomic<unsigned long long> sum;
+	std::atomic<unsigned long long> max;
+};
+
+/// Copies of _T on separate cache lines, every thread updates the one chosen when it first used
+/// any sharded value. Threads share a shard only when there are more threads than shards.
+template<typename _T>
+class thread_sharded {
+	struct alignas(64) shard {
+		_T value;
+	};
+public:
+	static size_t const count = 16;
+	_T& local(void)
+	{
+		return shards[threadIndex() % count].value;
+	}
+	template<typename _Fn>
+	void forEach(_Fn&& fn) const
+	{
+		for (shard const& s : shards)
+			fn(s.value);
+	}
+private:
+	static size_t threadIndex(void)
+	{
+		static std::atomic<size_t> threads(0);
+		thread_local size_t const index = threads.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+	shard shards[count];
+};
+
+/// Producers which use writer loaded from LogsFactoryImpl::binlog_target or clog_target, or layout of
+/// a writer, count themselves in shards of the current epoch until they are done with it. Factory changes
+/// the target and calls synchronize, after that the replaced writer or layout can be destroyed.
+class TargetReaders {
+public:
+	/// Must be created before the target is loaded
+	class Scope {
+		Scope(Scope const&) = delete;
+		void operator = (Scope const&) = delete;
+	public:
+		Scope(void)
+			: count(readers[epoch.load(std::memory_order_seq_cst) & 1].local())
+		{
+			count.fetch_add(1, std::memory_order_seq_cst);
+		}
+		~Scope()
+		{
+			count.fetch_sub(1, std::memory_order_release);
+		}
+	private:
+		std::atomic<unsigned int>& count;
+	};
+	/// Waits for producers which could load the target before it was changed. New producers count in
+	/// the other epoch, so waiting ends even if the target is used all the time.
+	static void synchronize(void);
+private:
+	static std::atomic<unsigned int>                  epoch;
+	static thread_sharded<std::atomic<unsigned int>>  readers[2];
+};
 
 //Ako je jedan ostream zajednicki za sve threadove onda treba queue i worker thread za ispisivanje
+//Producers don't lock, every line (prefix and message) is one record in bounded lock-free queue.
 class QueueWriter : public BufferWriterWithModifers {
 	QueueWriter(QueueWriter const&) = delete;
 	void operator = (QueueWriter const&) = delete;
-	typedef std::list<std::wstring> MsgQueue;
-	typedef std::shared_ptr<MsgQueue> MsgQueuePtr;
+	typedef bounded_mpsc_queue<LogRecord> MsgQueue;
 public:
-	QueueWriter(StdBufPtr sbuf, RotateFileFn rotate, std::shared_ptr<size_t> bymax);
+	/// If binsbuf is given deferred records are written to it unformatted, otherwise they are formatted to sbuf.
+	/// When bymax octets are written backend continues in the file from opennext, the next file is
+	/// opened ahead when the current one is 3/4 full. Producers never rotate.
+	/// Text records are also given to sinks.
+	QueueWriter(Utf8BufPtr sbuf, OpenNextFileFn opennext, RotationSizePtr bymax, QueuePolicy const& policy = QueuePolicy(), BinBufPtr binsbuf = BinBufPtr(), SinkRegistryPtr sinks = SinkRegistryPtr());
 	~QueueWriter(void);
 	void WriteAllLogsBeforeFinish(bool all = true) 
 	{ 
 		allwrite = all; 
 	}
 	std::streamsize write(wchar_t const* s, std::streamsize n);
+	std::streamsize write(char const* s, std::streamsize n);
+	/// Queues deferred record \see BinlogEncoder
+	void writeBinary(char const* data, size_t n, loglevel_e lvl);
+	/// Overflow policy, capacity of existing queue isn't changed
+	void setPolicy(QueuePolicy const& policy);
+	unsigned long long getDropped(void) const
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+	/// Adds counters of this writer to stats
+	void getStats(LogWriterStats& stats) const;
+	/// Queues lines collected by all threads, waits if queue is full
+	void flushCoalesced(void);
+	/// Queues collected lines and waits until backend writes and flushes everything queued before the call.
+	/// Not from sinks, their backend would wait for itself.
+	void drain(void);
+	/// visit(LogRecord const&) for records which backend hasn't written yet \see FlightRecorder::dump
+	template<typename _Fn>
+	void forEachPending(_Fn&& visit) const
+	{
+		logs.peek(visit);
+	}
 private:
 	void BackendWorker(void);
-	StdBufPtr                     sbuf;
-	RotateFileFn                  rotate;
-	std::shared_ptr<size_t> const bymax;
-	size_t                        bycount;
-	bool                          finish;
-	bool                          allwrite;
-	std::mutex                    mutex;
-	MsgQueuePtr                   logs;
+	/// fill(LogRecord&) writes record in place, if queue is full overflow policy is applied
+	template<typename _Fn>
+	void push(_Fn&& fill, loglevel_e lvl);
+	/// append(std::string&) adds line to lines of this thread, they are queued when there's enough of them
+	template<typename _Fn>
+	void coalesce(_Fn&& append, loglevel_e lvl);
+	CoalescedLines& coalescedForThread(void);
+	/// Caller holds lines.lock. Without wait it's given up if queue is full.
+	bool queueCoalesced(CoalescedLines& lines, bool wait);
+	/// Backend queues lines which waited too long or whose thread ended, busy ones are skipped
+	void queueExpired(void);
+	/// Timeout of backend wait, 0 when lines aren't collected
+	unsigned int coalesceDelay(void) const
+	{
+		return coalescebytes.load(std::memory_order_relaxed) ? coalescems.load(std::memory_order_relaxed) : 0;
+	}
+	/// Backend counts written octets and switches to the next file
+	void rotateIfFull(size_t len);
+	Utf8BufPtr                    sbuf; // changed only by backend
+	FileSinkBufPtr                nextsbuf; // pre-opened by backend
+	BinBufPtr                     binsbuf;
+	SinkRegistryPtr const         sinks;
+	OpenNextFileFn                opennext;
+	RotationSizePtr const         bymax;
+	size_t                        bycount; // only backend
+	size_t                        openretry; // bycount when opening of the next file is tried again after failure
+	std::atomic<int>              overflow; // overflow_e
+	std::atomic<int>              keeplevel;
+	std::atomic<unsigned int>     dropreportms;
+	std::atomic<unsigned long long> dropped;
+	std::atomic<size_t>           coalescebytes;
+	std::atomic<unsigned int>     coalescems;
+	std::mutex                    coalescedlock; // of the list, backend only tries it
+	std::vector<CoalescedLinesPtr> coalesced;
+	std::atomic<bool>             finish;
+	std::atomic<bool>             allwrite;
+	std::atomic<unsigned long long> records; // statistics written only by backend
+	std::atomic<unsigned long long> bytes;
+	std::atomic<unsigned long long> rotations;
+	AtomicHistogram               latencyns;
+	AtomicHistogram               batchrecords;
+	AtomicHistogram               batchns;
+	AtomicHistogram               rotationns;
+	thread_sharded<AtomicHistogram> waitns; // by producers
+	MsgQueue                      logs;
+	event_notifier                logs_ready;
+	event_notifier                logs_room; // consumer popped, producers of full queue retry
+	DrainMark                     drained;
 	thread_type                   worker;
 };
 
@@ -93,49 +611,77 @@ typedef std::shared_ptr<QueueWriter> QueueWriterPtr;
 /// no synchronization as appropriate for per-thread ostream /see GetTlogOutput
 class NoModifiersWriter : public BufferWriterWithModifers {
 public:
-	NoModifiersWriter(StdBufPtr sbuf)
+	NoModifiersWriter(Utf8BufPtr sbuf)
 		: sbuf(sbuf)
 	{ }
 	std::streamsize write(wchar_t const* s, std::streamsize n);
+	std::streamsize write(char const* s, std::streamsize n);
 protected:
-	StdBufPtr sbuf;
+	Utf8BufPtr sbuf;
 };
 
 typedef std::shared_ptr<NoModifiersWriter> NoModifiersWriterPtr;
 
-class LoggerBuf : public std::wstreambuf {
-	LoggerBuf(void) = delete;
+/// Line which one thread is collecting for one BasicLoggerBuf
+template<typename _Char>
+struct ThreadPutArea {
+	std::uint64_t        owner; // id of the buffer, never reused unlike its address
+	std::weak_ptr<void>  alive; // expires with the owner
+	std::vector<_Char>   chars; // at least bufsize of the owner, grows for longer records
+};
+
+/// Collects one line of log stream and gives it to the writer. Instantiated for wide (std::wclog)
+/// and UTF-8 (std::clog) streams which share writers. The stream is used by all threads so the
+/// buffer has no put area of its own, each thread collects its line in its own ThreadPutArea and
+/// the whole line is given to the writer without any lock. Put area grows for long records so the
+/// writer gets one record at once, only records longer than maxrecord are split. Every insert is a virtual
+/// call, which is felt only when lines are put one character at a time (bench_bmulog --apis chars).
+template<typename _Char>
+class BasicLoggerBuf : public std::basic_streambuf<_Char> {
+	BasicLoggerBuf(void) = delete;
+	typedef std::basic_streambuf<_Char> base_type;
 public:
-	LoggerBuf(BufferWriterWithModifersPtr bufwriter, size_t bufsize = 4096);
-	~LoggerBuf()
-	{
-		int dummy = 0;
-	}
-	int overflow(wchar_t c);
+	typedef typename base_type::int_type    int_type;
+	typedef typename base_type::traits_type traits_type;
+	BasicLoggerBuf(BufferWriterWithModifersPtr bufwriter, size_t bufsize = 4096, size_t maxrecord = 1024 * 1024);
+	int_type overflow(int_type c);
+	std::streamsize xsputn(_Char const* s, std::streamsize n);
 	int sync(void);
-	std::wstreambuf* setbuf(wchar_t*, std::streamsize)
+	base_type* setbuf(_Char*, std::streamsize)
 	{
 		return this;
 	}
 private:
+	ThreadPutArea<_Char>& putAreaForThread(void);
+	/// Gives collected characters to the writer, false if it didn't take all of them
+	bool writeLine(ThreadPutArea<_Char>& area);
 	BufferWriterWithModifersPtr bufwriter;
 	size_t                      bufsize;
-	std::shared_ptr<wchar_t>    bufptr;
-	wchar_t* const              pbeg;
-	wchar_t* const              pend;
+	size_t                      maxrecord;
+	std::uint64_t const         id;
+	std::shared_ptr<void>       alive;
 };
 
+typedef BasicLoggerBuf<wchar_t> LoggerBuf;
+typedef BasicLoggerBuf<char> Utf8LoggerBuf;
 typedef std::shared_ptr<LoggerBuf> LoggerBufPtr;
+typedef std::shared_ptr<Utf8LoggerBuf> Utf8LoggerBufPtr;
 
 /// Pridružuje baferom sa modifikatorima std::wclog streamu sa pri čemu izlaz može biti fajl umjesto terminal
+/// std::clog gets UTF-8 buffer with the same writer so both streams end in the same output.
 class LogsFactoryImpl {
 public:
 	LogsFactoryImpl(void);
 	~LogsFactoryImpl();
 	void setModifiers(std::list<LogModifierFn> const& m);
+	void setPrefixLayout(std::wstring const& pattern);
 	void setClogRotationSize(size_t bymax)
 	{
-		*clog_file_bymax = bymax;
+		clog_file_bymax->store(bymax, std::memory_order_relaxed);
+	}
+	void setClogFileBatching(FileBatching const& batching)
+	{
+		clog_file_batching = batching;
 	}
 	void setClogOutput(std::wstring const filename);
 	std::wostream& getTlogOutput(void) 
@@ -149,25 +695,77 @@ public:
 	void setTlogOutputPrefix(std::wstring const& filename_prefix)
 	{ 
 		tlogfile_name_prefix  = filename_prefix;
+		++tlog_generation; // every thread resolves its file again
+	}
+	/// Per-thread file of thread log, nullptr for fallback to clog output. It's cached in thread-local
+	/// slot which stays valid until tlog_generation changes, so usual call is comparison and one load.
+	std::streambuf* getTlogStreambuf(void);
+	/// Deferred records go to this file unformatted. For filename.empty they are formatted into clog output.
+	void setBinlogOutput(std::wstring const& filename);
+	/// Writer for deferred records, null if there is no LogsFactory instance. Load it in TargetReaders::Scope.
+	static std::atomic<QueueWriter*> binlog_target;
+	/// Writer of std::clog for formatted records \see LVLFLOG, null if there is no LogsFactory instance.
+	/// Load it in TargetReaders::Scope.
+	static std::atomic<QueueWriter*> clog_target;
+	/// structformat_e used by backends \see LogsFactoryBase::setStructuredFormat
+	static std::atomic<int> struct_format;
+	void setQueuePolicy(QueuePolicy const& policy);
+	unsigned long long getDroppedRecords(void);
+	std::vector<LogWriterStats> getStats(void);
+	void setOutputLevel(loglevel_e maxlevel)
+	{
+		output_maxlevel = maxlevel;
+		logmanip::setOutputLevels(output_maxlevel, sinks->maxLevel());
+	}
+	void setSink(std::string const& name, LogSinkPtr sink, loglevel_e maxlevel, int worker)
+	{
+		sinks->set(name, sink, maxlevel, worker);
+		logmanip::setOutputLevels(output_maxlevel, sinks->maxLevel());
+	}
+	void removeSink(std::string const& name)
+	{
+		sinks->remove(name);
+		logmanip::setOutputLevels(output_maxlevel, sinks->maxLevel());
 	}
+	void flush(void);
+	void drain(void);
+	void setBackendPolicy(BackendPolicy const& policy);
 private:
+	/// binlog_target and clog_target after change of writers, replaced ones can be destroyed after it returns
+	void updateTargets(void);
+	/// Given to all writers, new clog file writer gets it too
+	void setLayout(PrefixLayoutPtr newlayout);
+	/// New file with date and time suffix, called by backend for rotation
+	static FileSinkBufPtr openClogFile(std::wstring const& fnamebase, FileBatching const& batching);
 	static void nodeleter(std::wstreambuf* /*p*/) { }
-	StdBufPtr getTlogStreambuf(void);
-	std::locale              locEnUTF8;
+	static void utf8nodeleter(std::streambuf* /*p*/) { }
+	/// Slow path of getTlogStreambuf, opens file of this thread or closes it when prefix is empty
+	std::streambuf* resolveTlogStreambuf(void);
+	/// Changed on change of prefix and of factory instance, thread-local slots of older one are stale
+	static std::atomic<unsigned int> tlog_generation;
 	StdBufPtr const          clog_orig_stdbuf;//backup, reverted in destructor
+	Utf8BufPtr const         clog_orig_utf8buf;//backup of std::clog buffer, terminal output of both streams
+	SinkRegistryPtr const    sinks; // shared by clog writers
+	loglevel_e               output_maxlevel; // \see setOutputLevel
 	QueueWriterPtr           clog_orig_writer; // referenca za update modifikatora
 	LoggerBufPtr             clog_orig_logbuf;
-	std::shared_ptr<size_t>  clog_file_bymax;
+	Utf8LoggerBufPtr         clog_orig_utf8logbuf;
+	RotationSizePtr          clog_file_bymax;
+	FileBatching             clog_file_batching;
+	QueuePolicy              queue_policy;
+	unsigned long long       retired_dropped; // by writers which were replaced
 	QueueWriterPtr           clog_file_writer; // referenca za update modifikatora
 	LoggerBufPtr             clog_file_logbuf; // mijenja se pri zamjeni fajla
+	Utf8LoggerBufPtr         clog_file_utf8logbuf;
 	QueueWriterPtr           prev_clog_file_writer; // referenca za update modifikatora
 	LoggerBufPtr             prev_clog_file_logbuf; // mijenja se pri zamjeni fajla
+	Utf8LoggerBufPtr         prev_clog_file_utf8logbuf;
+	QueueWriterPtr           binlog_writer;
 	std::wstring              tlogfile_name_prefix;
 	TargetDirectWriterPtr    tlog_writer; // referenca za update modifikatora
 	LoggerBufPtr             tlog_logbuf;
 	OstreamPtr               tlog_ostream;
-	tss_ptr<StdBufPtr>       tlog_stdbuf; // per-thread filebuf
-	std::list<LogModifierFn> modifiers;
+	PrefixLayoutPtr          layout;
 };
 
 }
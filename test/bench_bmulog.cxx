@@ -1,24 +1,106 @@
 #include "bmu/Logger.h"
-#include <experimental/filesystem>
+#include "bmu/Format.h"
+#include "bench_suite.h"
+#include <cstring>
+
+// Throughput and per-call latency of clog and thread log lines for every combination of output,
+// logging API (wide and UTF-8 stream, {} format), modifiers, thread count and message size.
+// Results can be appended to JSON file together with bench_glog ones. Files are written to current directory. Builds on Linux with
+//   g++ -std=c++17 -O2 -pthread -I<dir containing bmu> src/*.cxx test/bench_bmulog.cxx -o bench_bmulog
+// (GenericURI, LexerChars and MD5Calc are not needed). Tests build the same way, except test_codepoint
+// which uses Windows.h and MSVC types and is Windows only.
+
+class NullBuf : public std::streambuf {
+protected:
+	int_type overflow(int_type c)
+	{
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(char const*, std::streamsize n)
+	{
+		return n;
+	}
+};
+
+enum api_e { API_WCLOG, API_CLOG, API_FORMAT, API_CHARS };
+
+struct Api {
+	char const* name;
+	api_e       kind;
+};
+
+struct Modifiers {
+	char const*                   name;
+	std::list<bmu::LogModifierFn> list;
+};
 
 int main(int argc, char* argv[])
 {
-	std::experimental::filesystem::create_directories("logs");
-	bmu::LogsFactoryPtr logger_scope(bmu::LogsFactory::create());
-	logger_scope->setClogOutput("logs/bmulog-bench");
-	// log to a file with rotation at size 5MB
-	logger_scope->setClogRotationSize(5 * 1024 * 1024);
-	logger_scope->setModifiers({ bmu::logmod_time, bmu::logmod_threadid });
-	int msgcount = 1000000;
-	std::cout << "Started bmulog bench" << std::endl;
-	
-	auto now1 = std::chrono::system_clock::now();
-	for (int i = 0; i < msgcount; ++i)
-		std::clog << FILE_AT << " bmulog message repetition " << i << ": This is some random log message repeated many times" << std::endl;
-	auto now2 = std::chrono::system_clock::now();
-
-	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1);
-	std::cout << "Finished in " << (diff.count() / 1000.0) << " seconds" << std::endl;
-	std::cin.get();
+	bench::Options opts;
+	if (!bench::parseOptions(argc, argv, opts)) {
+		bench::usage(argv[0]);
+		return 2;
+	}
+	NullBuf nullbuf;
+	std::streambuf* const clogbuf = std::clog.rdbuf(&nullbuf); // factory takes it as original clog output
+	std::vector<Modifiers> const modifiers = {
+		{ "none", {} },
+		{ "time,threadid", { bmu::logmod_time, bmu::logmod_threadid } },
+	};
+	Api const apis[] = {
+		{ "wclog", API_WCLOG },
+		{ "clog", API_CLOG },
+		{ "format", API_FORMAT },
+		{ "chars", API_CHARS }, // message put one character at a time, the worst case of stream buffer
+	};
+	std::vector<bench::Result> results;
+	for (char const* output : { "null", "file", "tlog" }) {
+		if (!bench::wanted(opts.outputs, output))
+			continue;
+		bool const tlog = 0 == std::strcmp("tlog", output);
+		for (Api const& api : apis) {
+			if (!bench::wanted(opts.apis, api.name) || (tlog && API_WCLOG != api.kind)) // thread log is only wide stream
+				continue;
+			for (Modifiers const& mods : modifiers) {
+				for (int threads : opts.threads) {
+					for (size_t size : opts.sizes) {
+						bench::Scenario const sc = { api.name, output, mods.name, threads, size };
+						bmu::LogsFactoryPtr factory(bmu::LogsFactory::create());
+						factory->setModifiers(mods.list);
+						if (0 == std::strcmp("file", output))
+							factory->setClogOutput(L"bench_bmulog_file");
+						else if (tlog)
+							factory->setTlogOutputPrefix(L"bench_bmulog_tlog_");
+						std::wstring const message(size, L'x');
+						std::string const message8(size, 'x');
+						auto log = [&](size_t i) {
+							if (tlog) {
+								INFOTLOG(L"bench_bmulog " << i << L": " << message);
+							}
+							else if (API_WCLOG == api.kind) {
+								INFOCLOG(L"bench_bmulog " << i << L": " << message);
+							}
+							else if (API_CLOG == api.kind) {
+								INFOCLOG8("bench_bmulog " << i << ": " << message8);
+							}
+							else if (API_CHARS == api.kind) {
+								std::clog << bmu::logmanip::level(bmu::LINFO) << "bench_bmulog " << i << ": ";
+								for (char c : message8)
+									std::clog.put(c);
+								std::clog << std::endl;
+							}
+							else {
+								INFOFLOG("bench_bmulog {}: {}", i, message8);
+							}
+						};
+						results.push_back(bench::run(sc, opts.lines, log, [&] { factory.reset(); }));
+						bench::print(results.back());
+					}
+				}
+			}
+		}
+	}
+	std::clog.rdbuf(clogbuf);
+	bench::appendJson(opts.json, "bmulog", opts.label, results);
 	return 0;
 }
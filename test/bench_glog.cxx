@@ -1,24 +1,34 @@
 #include "glog/logging.h"
-#include <chrono>
-#include <iostream>
-#include <experimental/filesystem>
+#include "bench_suite.h"
 
-int main(int, char* argv[])
+// The same scenarios as bench_bmulog with glog writing to files in current directory, so both
+// can be compared in one JSON file. glog has only file output and its own prefix of every line.
+
+int main(int argc, char* argv[])
 {
-	std::experimental::filesystem::create_directories("logs");
+	bench::Options opts;
+	if (!bench::parseOptions(argc, argv, opts)) {
+		bench::usage(argv[0]);
+		return 2;
+	}
 	FLAGS_logtostderr = 0;
-	FLAGS_log_dir = "logs";
+	FLAGS_log_dir = ".";
 	google::InitGoogleLogging(argv[0]);
-	int msgcount = 1000000;
-	std::cout << "Started glog bench" << std::endl;
-
-	auto now1 = std::chrono::system_clock::now();
-	for (int i = 0; i < msgcount; ++i)
-		LOG(INFO) << "glog message repetition " << i << ": This is some random log message repeated many times";
-	auto now2 = std::chrono::system_clock::now();
-
-	auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1);
-	std::cout << "Finished in " << (diff.count() / 1000.0) << " seconds" << std::endl;
-	std::cin.get();
+	std::vector<bench::Result> results;
+	if (bench::wanted(opts.outputs, "file") && bench::wanted(opts.apis, "stream")) {
+		for (int threads : opts.threads) {
+			for (size_t size : opts.sizes) {
+				bench::Scenario const sc = { "stream", "file", "glog", threads, size };
+				std::string const message(size, 'x');
+				auto log = [&](size_t i) {
+					LOG(INFO) << "bench_glog " << i << ": " << message;
+				};
+				results.push_back(bench::run(sc, opts.lines, log, [] { google::FlushLogFiles(google::GLOG_INFO); }));
+				bench::print(results.back());
+			}
+		}
+	}
+	google::ShutdownGoogleLogging();
+	bench::appendJson(opts.json, "glog", opts.label, results);
 	return 0;
 }
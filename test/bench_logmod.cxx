@@ -0,0 +1,115 @@
+#include "bmu/Logger.h"
+#include <chrono>
+#include <ctime>
+#include <cwchar>
+#include <sstream>
+
+// Per-call cost of timestamp modifiers compared with formatting on every call as they did before
+// per-second caching. Output of cached modifiers is checked against the uncached one.
+
+class NullBuf : public std::wstreambuf {
+protected:
+	int_type overflow(int_type c)
+	{
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(wchar_t const*, std::streamsize n)
+	{
+		return n;
+	}
+};
+
+static std::tm local_time(std::chrono::system_clock::time_point now)
+{
+	std::time_t const now_time_t = std::chrono::system_clock::to_time_t(now);
+	std::tm local_tm;
+#if (defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+	localtime_s(&local_tm, &now_time_t);
+#else
+	localtime_r(&now_time_t, &local_tm);
+#endif
+	return local_tm;
+}
+
+static void uncached_date(bmu::StdBufPtr to_out)
+{
+	std::tm local_tm = local_time(std::chrono::system_clock::now());
+	wchar_t buf[128];
+	size_t cch = std::wcsftime(buf, sizeof(buf) / sizeof(buf[0]), L"%x ", &local_tm);
+	to_out->sputn(buf, cch);
+}
+
+static void uncached_time(bmu::StdBufPtr to_out)
+{
+	auto now = std::chrono::system_clock::now();
+	std::tm local_tm = local_time(now);
+	wchar_t buf[128];
+	size_t cch = std::wcsftime(buf, sizeof(buf) / sizeof(buf[0]), L"%X.", &local_tm);
+	to_out->sputn(buf, cch);
+	std::chrono::seconds::rep usec = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() % 1000000;
+	std::wstring usstr(std::to_wstring(usec) + L" ");
+	to_out->sputn(&usstr[0], usstr.size());
+}
+
+static void uncached_datetime(bmu::StdBufPtr to_out)
+{
+	std::tm local_tm = local_time(std::chrono::system_clock::now());
+	wchar_t buf[128];
+	size_t cch = std::wcsftime(buf, sizeof(buf) / sizeof(buf[0]), L"%y%m%d-%H%M%S ", &local_tm);
+	to_out->sputn(buf, cch);
+}
+
+static double nanos_per_call(bmu::LogModifierFn fn, int count)
+{
+	NullBuf nullbuf;
+	bmu::StdBufPtr out(&nullbuf, [](std::wstreambuf*) { });
+	auto now1 = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i)
+		fn(out);
+	auto now2 = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now2 - now1).count() / (double)count;
+}
+
+/// Text up to the fractional part, same second is required so it's repeated if second changed
+static bool same_output(bmu::LogModifierFn cached, bmu::LogModifierFn uncached)
+{
+	for (int retry = 0; retry < 3; ++retry) {
+		std::wstringbuf b1, b2;
+		bmu::StdBufPtr p1(&b1, [](std::wstreambuf*) { });
+		bmu::StdBufPtr p2(&b2, [](std::wstreambuf*) { });
+		auto sec1 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		cached(p1);
+		uncached(p2);
+		auto sec2 = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		if (sec1 != sec2)
+			continue;
+		std::wstring const s1(b1.str()), s2(b2.str());
+		return s1.substr(0, s1.find(L'.')) == s2.substr(0, s2.find(L'.'))
+			&& (s1.find(L'.') == std::wstring::npos) == (s2.find(L'.') == std::wstring::npos)
+			&& s1.back() == L' ' && s2.back() == L' ';
+	}
+	return false;
+}
+
+int main(int argc, char* argv[])
+{
+	int const count = 1000000;
+	struct {
+		char const*         name;
+		bmu::LogModifierFn  cached;
+		bmu::LogModifierFn  uncached;
+	} const mods[] = {
+		{ "logmod_date", bmu::logmod_date, uncached_date },
+		{ "logmod_time", bmu::logmod_time, uncached_time },
+		{ "logmod_datetime", bmu::logmod_datetime, uncached_datetime },
+	};
+	bool ok = true;
+	for (auto const& mod : mods) {
+		bool const same = same_output(mod.cached, mod.uncached);
+		ok = ok && same;
+		std::cout << mod.name << ": " << nanos_per_call(mod.cached, count) << " ns/call cached, "
+			<< nanos_per_call(mod.uncached, count) << " ns/call uncached"
+			<< (same ? "" : " OUTPUT DIFFERS") << std::endl;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Common part of bench_bmulog and bench_glog. Both run the same scenarios and write results in the
+// same JSON, so runs can be compared across commits and between libraries. Every log call is timed
+// on its own, so latency includes about two reads of steady clock.
+
+namespace bench {
+
+struct Options {
+	std::vector<int>         threads = { 1, 2, 4, 8 };
+	std::vector<size_t>      sizes = { 16, 128, 1024 }; ///< characters of message after line number
+	std::vector<std::string> outputs; ///< empty for all which library has
+	std::vector<std::string> apis; ///< empty for all which library has
+	size_t                   lines = 50000; ///< per scenario, divided among threads
+	std::string              json; ///< results are appended to this file
+	std::string              label; ///< e.g. commit id, written to every result
+};
+
+struct Scenario {
+	std::string api; ///< how lines are logged, e.g. wclog, clog or format
+	std::string output; ///< null, file or tlog
+	std::string modifiers; ///< prefix of every line
+	int         threads;
+	size_t      size;
+};
+
+struct Result {
+	Scenario      scenario;
+	size_t        lines;
+	double        seconds; ///< from start of producers until the last one ends
+	double        drainseconds; ///< after producers until everything is written
+	std::uint64_t p50, p99, p999, max; ///< nanoseconds of one call
+};
+
+template<typename _T>
+inline bool parseList(char const* arg, std::vector<_T>& values)
+{
+	values.clear();
+	std::istringstream iss(arg);
+	for (std::string item; std::getline(iss, item, ','); ) {
+		std::istringstream one(item);
+		_T v;
+		if (!(one >> v))
+			return false;
+		values.push_back(v);
+	}
+	return !values.empty();
+}
+
+inline bool parseOptions(int argc, char* argv[], Options& opts)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string const arg(argv[i]);
+		char const* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!value)
+			return false;
+		++i;
+		if ("--threads" == arg) {
+			if (!parseList(value, opts.threads))
+				return false;
+		}
+		else if ("--sizes" == arg) {
+			if (!parseList(value, opts.sizes))
+				return false;
+		}
+		else if ("--outputs" == arg) {
+			if (!parseList(value, opts.outputs))
+				return false;
+		}
+		else if ("--apis" == arg) {
+			if (!parseList(value, opts.apis))
+				return false;
+		}
+		else if ("--lines" == arg)
+			opts.lines = std::strtoul(value, nullptr, 10);
+		else if ("--json" == arg)
+			opts.json = value;
+		else if ("--label" == arg)
+			opts.label = value;
+		else
+			return false;
+	}
+	return 0 < opts.lines;
+}
+
+inline void usage(char const* program)
+{
+	std::cerr << "Usage: " << program << " [--threads 1,2,4,8] [--sizes 16,128,1024] [--outputs null,file,tlog]"
+		" [--apis wclog,clog,format,chars]"
+		" [--lines 50000] [--json results.json] [--label name]" << std::endl;
+}
+
+inline bool wanted(std::vector<std::string> const& filter, std::string const& name)
+{
+	return filter.empty() || filter.end() != std::find(filter.begin(), filter.end(), name);
+}
+
+inline std::uint64_t nanosSince(std::chrono::steady_clock::time_point start)
+{
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Calls log(line) on sc.threads threads for lines in total, then drain() which returns when
+/// everything is written
+template<typename _Fn, typename _Drain>
+inline Result run(Scenario const& sc, size_t lines, _Fn&& log, _Drain&& drain)
+{
+	size_t const perthread = (lines + sc.threads - 1) / sc.threads;
+	std::vector<std::vector<std::uint32_t>> latencies(sc.threads);
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> producers;
+	for (int t = 0; t < sc.threads; ++t) {
+		latencies[t].reserve(perthread);
+		producers.emplace_back([&, t] {
+			std::vector<std::uint32_t>& mine = latencies[t];
+			++ready;
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			for (size_t i = 0; i < perthread; ++i) {
+				auto const start = std::chrono::steady_clock::now();
+				log(i);
+				std::uint64_t const ns = nanosSince(start);
+				mine.push_back(ns < UINT32_MAX ? (std::uint32_t)ns : UINT32_MAX);
+			}
+		});
+	}
+	while (ready.load() < sc.threads)
+		std::this_thread::yield();
+	auto const start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (std::thread& producer : producers)
+		producer.join();
+	Result r;
+	r.scenario = sc;
+	r.seconds = nanosSince(start) / 1e9;
+	auto const drainstart = std::chrono::steady_clock::now();
+	drain();
+	r.drainseconds = nanosSince(drainstart) / 1e9;
+	std::vector<std::uint32_t> all;
+	all.reserve(perthread * sc.threads);
+	for (std::vector<std::uint32_t> const& mine : latencies)
+		all.insert(all.end(), mine.begin(), mine.end());
+	r.lines = all.size();
+	auto percentile = [&](double fraction) -> std::uint64_t {
+		if (all.empty())
+			return 0;
+		size_t const k = std::min(all.size() - 1, (size_t)(fraction * all.size()));
+		std::nth_element(all.begin(), all.begin() + k, all.end());
+		return all[k];
+	};
+	r.p50 = percentile(0.5);
+	r.p99 = percentile(0.99);
+	r.p999 = percentile(0.999);
+	r.max = all.empty() ? 0 : *std::max_element(all.begin(), all.end());
+	return r;
+}
+
+inline void print(Result const& r)
+{
+	std::cout << r.scenario.api << " " << r.scenario.output << " " << r.scenario.modifiers << " threads=" << r.scenario.threads
+		<< " size=" << r.scenario.size << ": " << (size_t)(r.lines / r.seconds) << " lines/s, p50 " << r.p50
+		<< " p99 " << r.p99 << " p99.9 " << r.p999 << " max " << r.max << " ns, drain "
+		<< r.drainseconds * 1000 << " ms" << std::endl;
+}
+
+/// One JSON object per line, file can be read line by line or as JSON Lines
+inline void appendJson(std::string const& filename, std::string const& library, std::string const& label, std::vector<Result> const& results)
+{
+	if (filename.empty())
+		return;
+	std::ofstream out(filename, std::ios::app);
+	for (Result const& r : results) {
+		out << "{\"library\":\"" << library << "\",\"label\":\"" << label
+			<< "\",\"api\":\"" << r.scenario.api << "\",\"output\":\"" << r.scenario.output << "\",\"modifiers\":\"" << r.scenario.modifiers
+			<< "\",\"threads\":" << r.scenario.threads << ",\"size\":" << r.scenario.size
+			<< ",\"lines\":" << r.lines << ",\"seconds\":" << r.seconds
+			<< ",\"lines_per_second\":" << (r.seconds > 0 ? r.lines / r.seconds : 0)
+			<< ",\"drain_seconds\":" << r.drainseconds
+			<< ",\"latency_ns\":{\"p50\":" << r.p50 << ",\"p99\":" << r.p99 << ",\"p999\":" << r.p999
+			<< ",\"max\":" << r.max << "}}\n";
+	}
+}
+
+}
@@ -0,0 +1,113 @@
+#include "bmu/Logger.h"
+#include "bmu/thread_types.hxx"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <sstream>
+#include <vector>
+
+// Resolving per-thread file of thread log through std::function and tss_ptr map as it was done
+// before, compared with thread-local slot checked against generation counter as LogsFactoryImpl
+// does now. Then whole thread log lines in one and in several threads, each one with its own file.
+
+typedef std::shared_ptr<std::streambuf> Utf8BufPtr;
+
+class NullBuf : public std::streambuf {
+protected:
+	int_type overflow(int_type c)
+	{
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(char const*, std::streamsize n)
+	{
+		return n;
+	}
+};
+
+/// Former getTlogStreambuf, given buffer stands for opened file
+struct MapLookup {
+	std::wstring             prefix;
+	Utf8BufPtr               file;
+	bmu::tss_ptr<Utf8BufPtr> stdbuf;
+	Utf8BufPtr get(void)
+	{
+		if (!prefix.empty()) {
+			if (!stdbuf.get())
+				stdbuf.reset(new Utf8BufPtr(file));
+			if (stdbuf.get())
+				return *stdbuf.get();
+		}
+		else if (stdbuf.get())
+			stdbuf.reset();
+		return Utf8BufPtr();
+	}
+};
+
+/// Current getTlogStreambuf, the slow path only fills the slot
+struct SlotLookup {
+	std::atomic<unsigned int> generation{ 1 };
+	std::streambuf*           sbuf = nullptr;
+	std::streambuf* get(void)
+	{
+		static thread_local SlotLookup const* owner = nullptr;
+		static thread_local unsigned int resolved = 0;
+		static thread_local std::streambuf* slot = nullptr;
+		if (resolved == generation.load(std::memory_order_acquire) && owner == this)
+			return slot;
+		owner = this;
+		resolved = generation.load(std::memory_order_acquire);
+		return slot = sbuf;
+	}
+};
+
+template<typename _Fn>
+static double nanos_per_call(_Fn fn, int count)
+{
+	auto now1 = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i)
+		fn();
+	auto now2 = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now2 - now1).count() / (double)count;
+}
+
+static double nanos_per_line(int threads, int count)
+{
+	std::vector<bmu::thread_type> workers;
+	auto now1 = std::chrono::steady_clock::now();
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([count] {
+			for (int i = 0; i < count; ++i)
+				INFOTLOG(L"bench_tlog message repetition " << i << L": This is some random log message repeated many times");
+		});
+	}
+	for (bmu::thread_type& worker : workers)
+		worker.join();
+	auto now2 = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now2 - now1).count() / (double)count / threads;
+}
+
+int main(int argc, char* argv[])
+{
+	int const count = 10000000;
+	NullBuf nullbuf;
+	MapLookup maplookup;
+	maplookup.prefix = L"bench_tlog_";
+	maplookup.file.reset(&nullbuf, [](std::streambuf*) { });
+	std::function<Utf8BufPtr(void)> getsbuf(std::bind(&MapLookup::get, &maplookup));
+	SlotLookup slotlookup;
+	slotlookup.sbuf = &nullbuf;
+	size_t found = 0;
+	double const mapns = nanos_per_call([&] { found += getsbuf() ? 1 : 0; }, count);
+	double const slotns = nanos_per_call([&] { found += slotlookup.get() ? 1 : 0; }, count);
+	std::cout << "tlog file lookup: " << mapns << " ns/call std::function and tss_ptr, "
+		<< slotns << " ns/call thread-local slot" << std::endl;
+
+	bmu::LogsFactoryPtr logger_scope(bmu::LogsFactory::create());
+	logger_scope->setModifiers({ bmu::logmod_time, bmu::logmod_threadid });
+	logger_scope->setTlogOutputPrefix(L"bench_tlog_");
+	int const linecount = 200000;
+	for (int threads : { 1, 4 })
+		std::cout << "tlog lines, " << threads << " threads: " << nanos_per_line(threads, linecount) << " ns/line" << std::endl;
+	logger_scope->setTlogOutputPrefix(std::wstring());
+	return 2 * (size_t)count == found ? 0 : 1;
+}
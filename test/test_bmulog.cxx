@@ -1,4 +1,91 @@
+#define BMU_LOG_COMPILED_LEVEL ::bmu::LTRACE // DUMP calls are removed at compile time
 #include "bmu/Logger.h"
+#include "bmu/BinLog.h"
+#include "bmu/FlightRecorder.h"
+#include "bmu/Format.h"
+#include "bmu/LogIndex.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#ifdef _WIN32
+# include <Windows.h>
+#else
+# include <dirent.h>
+#endif
+
+/// Sorted names of files in the working directory which start with prefix, e.g. clog files with time suffix
+static std::vector<std::string> listFiles(std::string const& prefix)
+{
+	std::vector<std::string> names;
+#ifdef _WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE const h = FindFirstFileA((prefix + "*").c_str(), &found);
+	if (INVALID_HANDLE_VALUE != h) {
+		do {
+			names.push_back(found.cFileName);
+		} while (FindNextFileA(h, &found));
+		FindClose(h);
+	}
+#else
+	if (DIR* const dir = opendir(".")) {
+		while (dirent const* const entry = readdir(dir)) {
+			if (0 == std::strncmp(entry->d_name, prefix.c_str(), prefix.size()))
+				names.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+#endif
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+static std::string readFile(std::string const& name)
+{
+	std::ifstream in(name, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+/// Backend which writes the marked line stays in the sink until it's released
+class StalledSink : public bmu::LogSink {
+public:
+	StalledSink(void)
+		: entered(false)
+		, released(false)
+	{ }
+	void write(char const* line, size_t n, bmu::loglevel_e /*lvl*/)
+	{
+		if (std::string::npos == std::string(line, n).find("Line which stalls the backend"))
+			return;
+		entered = true;
+		while (!released)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::atomic<bool> entered;
+	std::atomic<bool> released;
+};
+
+/// Sink which changes sinks from its write, e.g. removes itself after an error
+class ReentrantSink : public bmu::LogSink {
+public:
+	explicit ReentrantSink(bmu::LogsFactoryBase* logs)
+		: logs(logs)
+		, entered(false)
+		, writes(0)
+	{ }
+	void write(char const* /*line*/, size_t /*n*/, bmu::loglevel_e /*lvl*/)
+	{
+		++writes;
+		if (entered.exchange(true))
+			return;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100)); // pool is being replaced meanwhile
+		logs->removeSink("absent");
+	}
+	bmu::LogsFactoryBase* logs;
+	std::atomic<bool> entered;
+	std::atomic<int> writes;
+};
 
 int main(int argc, char* argv[])
 {
@@ -74,9 +161,468 @@ int main(int argc, char* argv[])
 				lsroot->setLoglevel(lvl);
 				curlev = lvl;
 			}
+			// effective loglevel follows parent until scope gets its own
+			assert(!lsleaf11->isEnabled(bmu::LWARN) && lsleaf11->isEnabled(bmu::LERROR));
+			lsbranch2->setLoglevel(bmu::LDUMP);
+			lsroot->setLoglevel(bmu::LINFO);
+			assert(lsleaf12->isEnabled(bmu::LINFO) && !lsleaf12->isEnabled(bmu::LTRACE));
+			assert(lsleaf21->isEnabled(bmu::LDUMP));
+			std::wclog << lsleaf22;
+			assert(bmu::logmanip::isEnabled(bmu::LDUMP));
+			lsbranch2->resetLoglevel();
+			assert(!bmu::logmanip::isEnabled(bmu::LTRACE) && !lsleaf21->isEnabled(bmu::LTRACE));
 		}
 		wchar_t wcMsg[] = L"\u0425\u0435\u043B\u043B\u043E\u0443 \u0442\u0445\u0435\u0440\u0435!";//NOTE: source code file should be encoded as UTF-8 with BOM
 		std::wclog << "UTF-16 string: " << wcMsg << std::endl;
+		bmu::Utf8Log(std::clog) << "UTF-8 string: " << "\xD0\xA5\xD0\xB5\xD0\xBB\xD0\xBB\xD0\xBE\xD1\x83!" << " and converted " << wcMsg << std::endl;
+		INFOCLOG8("Narrow info " << 42 << " in the same output");
+
+		{
+			bmu::LogScopePtr lsdump(bmu::LogScope::create(nullptr));
+			lsdump->setLoglevel(bmu::LDUMP);
+			std::wclog << lsdump;
+			int evaluated = 0;
+			TRACECLOG("Trace is compiled " << ++evaluated);
+			DUMPCLOG("Dump is not compiled " << ++evaluated);
+			DUMPBLOG("Dump is not compiled {}", ++evaluated);
+			assert(1 == evaluated);
+		}
+		std::wclog << bmu::LogScopePtr(); // back to default loglevel
+		{
+			bmu::LogSite every4, first2, sampled;
+			unsigned long long suppressed = 0, logged = 0, sampledcount = 0;
+			for (int i = 0; i < 10; ++i)
+				logged += every4.everyN(suppressed, 4) ? 1 : 0;
+			assert(3 == logged && 3 == suppressed);
+			logged = 0;
+			for (int i = 0; i < 10; ++i)
+				logged += first2.firstN(suppressed, 2) ? 1 : 0;
+			assert(2 == logged);
+			for (int i = 0; i < 1000; ++i)
+				sampledcount += sampled.sampled(suppressed, 0.0) ? 1 : 0;
+			bool const always = sampled.sampled(suppressed, 1.0);
+			assert(0 == sampledcount && always && 1000 == suppressed);
+			for (int i = 0; i < 100; ++i) {
+				LVLCLOG_EVERY_N(bmu::LWARN, 50, "Every 50th warning " << i);
+				LVLCLOG8_FIRST_N(bmu::LINFO, 1, "Only first info " << i);
+				LVLCLOG_EVERY_T(bmu::LINFO, 3600, "Once per hour " << i);
+				LVLTLOG_SAMPLED(bmu::LINFO, 0.01, "Sampled thread log " << i);
+			}
+		}
+		{
+			static constexpr bmu::SourceSite here = SOURCE_SITE;
+			static_assert(here.line == __LINE__ - 1, "line of the site");
+			assert(std::string("test_bmulog.cxx") == here.file);
+			std::ostringstream oss;
+			oss << &here;
+			assert(oss.str() == bmu::srcpos_short(here.line, here.function, __FILE__));
+			std::wclog << L"Site " << SOURCE_SITE << std::endl;
+			assert(std::string::npos != std::string(SOURCE_AT).find("} in [test_bmulog.cxx]("));
+			TRACE_HERE
+			if (here.line) // one statement in debug and release build
+				DBGMSGAT("debug message at the site");
+			else
+				DBGMSG("never written");
+		}
+		{
+			std::wostringstream oss;
+			oss << L"test_bmulog_tlog_" << std::this_thread::get_id();
+			std::wstring const tlogname(oss.str());
+			logger_scope->setTlogOutputPrefix(L"test_bmulog_tlog_");
+			INFOTLOG("Thread log line in the file of the thread");
+			logger_scope->setTlogOutputPrefix(std::wstring());
+			INFOTLOG("Thread log line in clog output"); // the file is closed by this line
+			std::ifstream in(std::string(tlogname.begin(), tlogname.end()), std::ios::binary);
+			std::string const written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			assert(std::string::npos != written.find("Thread log line in the file of the thread\n"));
+			assert(std::string::npos == written.find("Thread log line in clog output"));
+		}
+		{
+			bmu::FileBatching batching; // tiny batches so lines longer than buffer are written too
+			batching.maxbytes = 64;
+			batching.datasync = bmu::DATASYNC_BATCH;
+			logger_scope->setClogFileBatching(batching);
+			logger_scope->setClogRotationSize(1024); // backend continues in the next file after 12 lines
+			for (std::string const& name : listFiles("test_bmulog_batched-"))
+				std::remove(name.c_str());
+			logger_scope->setClogOutput(L"test_bmulog_batched");
+			for (int i = 0; i < 22; ++i) // the third file is opened ahead and removed as unused
+				std::clog << "Batched line " << i << " written to the file with other lines of the batch" << std::endl;
+			logger_scope->setClogOutput(std::wstring());
+			logger_scope->setClogRotationSize(size_t(-1));
+			std::vector<std::string> const files(listFiles("test_bmulog_batched-"));
+			assert(2 == files.size());
+			std::string written; // suffixes of rotated files don't sort by time
+			for (std::string const& name : files) {
+				std::string const content(readFile(name));
+				assert(!content.empty());
+				written += content;
+			}
+			for (int i = 0; i < 22; ++i) { // every line once
+				std::string const line = "Batched line " + std::to_string(i) + " written to the file with other lines of the batch\n";
+				size_t const found = written.find(line);
+				assert(std::string::npos != found && std::string::npos == written.find(line, found + 1));
+			}
+		}
+		{
+			bmu::FileBatching batching; // index entry for every line
+			batching.indexrecords = 1;
+			auto const pause = [] { std::this_thread::sleep_for(std::chrono::milliseconds(50)); }; // more than system clock resolution
+			auto const start = std::chrono::system_clock::now();
+			pause();
+			bmu::LogSinkPtr first(bmu::createFileSink(L"test_bmulog_indexed_1", batching));
+			first->write("a0\n", 3, bmu::LINFO);
+			first->write("a1\n", 3, bmu::LINFO);
+			pause();
+			auto const between = std::chrono::system_clock::now();
+			pause();
+			first->write("a2\n", 3, bmu::LINFO);
+			first.reset();
+			pause();
+			bmu::LogSinkPtr second(bmu::createFileSink(L"test_bmulog_indexed_2", batching));
+			second->write("b0\n", 3, bmu::LINFO);
+			second.reset();
+			std::vector<std::wstring> const files = { L"test_bmulog_indexed_2", L"test_bmulog_not_indexed", L"test_bmulog_indexed_1" };
+			std::vector<bmu::LogRange> ranges(bmu::findLogRanges(files, start, std::chrono::system_clock::now()));
+			assert(2 == ranges.size() && L"test_bmulog_indexed_1" == ranges[0].filename && L"test_bmulog_indexed_2" == ranges[1].filename);
+			assert(0 == ranges[0].begin && 9 == ranges[0].end && 0 == ranges[1].begin && 3 == ranges[1].end);
+			ranges = bmu::findLogRanges(files, between, between, std::chrono::milliseconds(0));
+			assert(1 == ranges.size() && 3 == ranges[0].begin && 6 == ranges[0].end); // a1 was written before, a2 is already after
+			bmu::MappedFile mapped;
+			bool const opened = mapped.open(L"test_bmulog_indexed_1");
+			assert(opened && 9 == mapped.size() && 0 == std::memcmp("a1\n", mapped.data() + ranges[0].begin, 3));
+		}
+		{
+			bmu::QueuePolicy policy; // tiny queue of the new file writer overflows
+			policy.capacity = 4;
+			policy.overflow = bmu::OVERFLOW_DROP_BELOW_LEVEL;
+			policy.keeplevel = bmu::LWARN;
+			policy.dropreportms = 0;
+			logger_scope->setQueuePolicy(policy);
+			logger_scope->setClogOutput(L"test_bmulog_dropping");
+			for (int i = 0; i < 20000; ++i)
+				INFOCLOG8("Line " << i << " may be dropped");
+			WARNCLOG8("Warning is never dropped");
+			assert(0 < logger_scope->getDroppedRecords());
+			std::vector<bmu::LogWriterStats> const stats(logger_scope->getStats());
+			assert(2 == stats.size() && "clog file" == stats[1].name);
+			assert(4 == stats[1].queuecapacity && stats[1].queuedepth <= 4 && 0 < stats[1].dropped);
+			assert(0 < stats[0].records && 0 < stats[0].bytes && 0 < stats[0].latencyns.samples && 0 < stats[0].batchrecords.samples);
+			assert(stats[0].latencyns.percentile(0.5) <= stats[0].latencyns.percentile(0.99) && stats[0].latencyns.percentile(1.0) <= stats[0].latencyns.max);
+			logger_scope->setClogOutput(std::wstring());
+			logger_scope->setQueuePolicy(bmu::QueuePolicy());
+		}
+		{
+			bmu::QueuePolicy policy; // producers of tiny queue sleep until backend makes room
+			policy.capacity = 4;
+			policy.overflow = bmu::OVERFLOW_BLOCK;
+			logger_scope->setQueuePolicy(policy);
+			logger_scope->setClogOutput(L"test_bmulog_blocking");
+			std::vector<std::thread> producers;
+			for (int t = 0; t < 4; ++t) {
+				producers.emplace_back([t] {
+					for (int i = 0; i < 2000; ++i)
+						INFOCLOG8("Thread " << t << " line " << i << " waits for room");
+				});
+			}
+			for (std::thread& producer : producers)
+				producer.join();
+			logger_scope->drain();
+			std::vector<bmu::LogWriterStats> const stats(logger_scope->getStats());
+			assert(2 == stats.size() && "clog file" == stats[1].name && 0 == stats[1].dropped && 4 * 2000 <= stats[1].records);
+			logger_scope->setClogOutput(std::wstring());
+			logger_scope->setQueuePolicy(bmu::QueuePolicy());
+		}
+		{
+			bmu::QueuePolicy policy; // producer drops the oldest records itself while backend is stuck
+			policy.capacity = 4;
+			policy.overflow = bmu::OVERFLOW_DROP_OLDEST;
+			policy.dropreportms = 0;
+			logger_scope->setQueuePolicy(policy);
+			std::shared_ptr<StalledSink> const stalled(std::make_shared<StalledSink>());
+			logger_scope->setSink("stalled", stalled, bmu::LINFO);
+			logger_scope->setClogOutput(L"test_bmulog_stalled");
+			INFOCLOG8("Line which stalls the backend");
+			while (!stalled->entered)
+				std::this_thread::yield();
+			std::atomic<bool> done(false);
+			std::thread producer([&] {
+				for (int i = 0; i < 1000; ++i)
+					INFOCLOG8("Line " << i << " dropped while backend is stuck");
+				done = true;
+			});
+			for (int ms = 0; ms < 10000 && !done; ++ms)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			bool const returned = done;
+			stalled->released = true;
+			producer.join();
+			assert(returned);
+			std::vector<bmu::LogWriterStats> const stats(logger_scope->getStats());
+			assert(2 == stats.size() && "clog file" == stats[1].name && 1000 - 4 <= stats[1].dropped);
+			logger_scope->setClogOutput(std::wstring());
+			logger_scope->removeSink("stalled");
+			logger_scope->setQueuePolicy(bmu::QueuePolicy());
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(2));
+			logger_scope->setSink("ring", ring, bmu::LWARN);
+			logger_scope->setClogOutput(L"test_bmulog_sinks");
+			INFOCLOG8("Info only in the file");
+			WARNCLOG8("First warning also in the ring");
+			ERRCLOG("Error also in the ring");
+			WARNCLOG8("Last warning also in the ring");
+			logger_scope->setClogOutput(std::wstring()); // backend of the file has written everything
+			logger_scope->removeSink("ring");
+			std::vector<std::string> const lines(ring->lines());
+			assert(2 == lines.size());
+			assert(std::string::npos != lines[0].find("Error also in the ring"));
+			assert(std::string::npos != lines[1].find("Last warning also in the ring\n"));
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setOutputLevel(bmu::LWARN); // the file gets warnings, the ring traces too
+			logger_scope->setSink("ring", ring, bmu::LTRACE);
+			assert(bmu::logmanip::isEnabled(bmu::LTRACE) && !bmu::logmanip::isPrimaryOutput(bmu::LINFO));
+			for (std::string const& name : listFiles("test_bmulog_levels-"))
+				std::remove(name.c_str());
+			bmu::QueuePolicy policy;
+			policy.coalescebytes = 4096;
+			policy.coalescems = 60000; // the last line waits in this thread until the output level changes
+			logger_scope->setQueuePolicy(policy);
+			logger_scope->setClogOutput(L"test_bmulog_levels");
+			TRACECLOG8("Trace only in the ring");
+			INFOCLOG8("Info only in the ring");
+			WARNCLOG8("Warning in the file and in the ring");
+			INFOCLOG8("Info queued before the change is only in the ring");
+			logger_scope->setOutputLevel(bmu::LDUMP);
+			logger_scope->setClogOutput(std::wstring());
+			logger_scope->setQueuePolicy(bmu::QueuePolicy());
+			logger_scope->removeSink("ring");
+			assert(!bmu::logmanip::isEnabled(bmu::LTRACE) && bmu::logmanip::isPrimaryOutput(bmu::LINFO));
+			std::vector<std::string> const lines(ring->lines());
+			assert(4 == lines.size());
+			assert(std::string::npos != lines[0].find("Trace only in the ring"));
+			std::vector<std::string> const files(listFiles("test_bmulog_levels-"));
+			assert(1 == files.size());
+			std::string const written(readFile(files[0]));
+			assert(std::string::npos == written.find("only in the ring"));
+			assert(std::string::npos != written.find("Warning in the file and in the ring\n"));
+		}
+		{
+			bmu::QueuePolicy policy;
+			policy.coalescebytes = 4096;
+			policy.coalescems = 60000; // only level change and flush queue the lines
+			logger_scope->setQueuePolicy(policy);
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(8));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			logger_scope->setClogOutput(L"test_bmulog_coalesced");
+			for (int i = 0; i < 5; ++i)
+				INFOCLOG8("Coalesced line " << i);
+			assert(0 == logger_scope->getStats()[1].records);
+			WARNCLOG8("Warning queues previous lines");
+			logger_scope->flush();
+			logger_scope->setClogOutput(std::wstring());
+			std::vector<std::string> lines(ring->lines());
+			assert(6 == lines.size());
+			assert(std::string::npos != lines[0].find("Coalesced line 0\n"));
+			assert(std::string::npos != lines[5].find("Warning queues previous lines\n"));
+			policy.coalescems = 1;
+			logger_scope->setQueuePolicy(policy);
+			INFOCLOG8("Line queued by backend");
+			for (int i = 0; i < 200 && std::string::npos == ring->lines().back().find("Line queued by backend"); ++i)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			assert(std::string::npos != ring->lines().back().find("Line queued by backend\n"));
+			logger_scope->removeSink("ring");
+			logger_scope->setQueuePolicy(bmu::QueuePolicy());
+		}
+		{
+			bmu::BackendPolicy backend;
+			backend.sinkworkers = 2;
+			backend.cpus = { 0 };
+			backend.priority = -1;
+			logger_scope->setBackendPolicy(backend);
+			bmu::LogRingSinkPtr infos(std::make_shared<bmu::LogRingSink>(4));
+			bmu::LogRingSinkPtr warnings(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setSink("infos", infos, bmu::LINFO, 0);
+			logger_scope->setSink("warnings", warnings, bmu::LWARN, 1);
+			INFOCLOG8("Info written by the first sink worker");
+			WARNCLOG8("Warning written by both sink workers");
+			logger_scope->drain(); // backend and both sink workers
+			std::vector<std::string> const lines(infos->lines());
+			assert(2 == lines.size() && std::string::npos != lines[0].find("Info written by the first sink worker\n"));
+			assert(1 == warnings->lines().size() && std::string::npos != warnings->lines()[0].find("Warning written by both sink workers\n"));
+			logger_scope->removeSink("infos");
+			logger_scope->removeSink("warnings");
+			logger_scope->setBackendPolicy(bmu::BackendPolicy());
+		}
+		{
+			bmu::BackendPolicy backend;
+			backend.sinkworkers = 1;
+			logger_scope->setBackendPolicy(backend);
+			std::shared_ptr<ReentrantSink> const reentrant(std::make_shared<ReentrantSink>(logger_scope.get()));
+			logger_scope->setSink("reentrant", reentrant, bmu::LINFO);
+			INFOCLOG8("Info written by the sink worker which calls the registry");
+			while (!reentrant->entered)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			logger_scope->setBackendPolicy(bmu::BackendPolicy()); // replaced pool joins its worker still in the sink
+			INFOCLOG8("Info written by the backend");
+			logger_scope->drain();
+			assert(2 == reentrant->writes);
+			logger_scope->removeSink("reentrant");
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(400));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			std::vector<std::thread> writers;
+			for (int t = 0; t < 4; ++t) {
+				writers.emplace_back([t] {
+					for (int i = 0; i < 100; ++i) { // every thread collects its line apart from the others
+						std::wclog << L"Thread " << t;
+						std::this_thread::yield();
+						std::wclog << L" line " << i << std::endl;
+					}
+				});
+			}
+			for (std::thread& writer : writers)
+				writer.join();
+			logger_scope->drain();
+			logger_scope->removeSink("ring");
+			std::vector<std::string> const lines(ring->lines());
+			assert(400 == lines.size());
+			for (std::string const& line : lines) {
+				size_t const pos = line.find("Thread ");
+				assert(std::string::npos != pos && std::string::npos == line.find("Thread ", pos + 1));
+				assert(line.size() - pos <= std::strlen("Thread 3 line 99\n") && '\n' == line.back());
+			}
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			std::wstring const longer(3 * 4096, L'y');
+			INFOCLOG(L"Long record " << longer << L" ends here");
+			logger_scope->drain();
+			logger_scope->removeSink("ring");
+			std::vector<std::string> const lines(ring->lines());
+			assert(1 == lines.size()); // one prefix, not split at size of put area
+			assert(std::string::npos != lines[0].find("Long record " + std::string(longer.size(), 'y') + " ends here\n"));
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			logger_scope->setPrefixLayout(L"[%tid] %tname|%% %q %T.%us ");
+			std::wstring const name(bmu::logmanip::getThreadName());
+			bmu::logmanip::setThreadName(L"layout");
+			INFOCLOG(L"Line with compiled prefix");
+			bmu::logmanip::setThreadName(name);
+			logger_scope->setModifiers({ bmu::logmod_date, bmu::logmod_time });
+			logger_scope->drain();
+			logger_scope->removeSink("ring");
+			std::ostringstream id;
+			id << std::this_thread::get_id();
+			std::vector<std::string> const lines(ring->lines());
+			assert(1 == lines.size());
+			assert(0 == lines[0].find("[" + id.str() + "] layout|% %q "));
+			size_t const dot = lines[0].find('.', lines[0].find("%q ")); // %us is the fraction of logmod_time
+			size_t const end = lines[0].find(' ', dot);
+			assert(std::string::npos != dot && std::string::npos != end && end - dot >= 2 && end - dot <= 7);
+			assert(std::all_of(&lines[0][dot + 1], &lines[0][end], [](char c) { return c >= '0' && c <= '9'; }));
+			assert(std::string::npos != lines[0].find(" Line with compiled prefix\n"));
+		}
+		{
+			static_assert(2 == bmu::format_placeholders("{} {{}} {}"), "");
+			static_assert(-1 == bmu::format_placeholders("single { brace"), "");
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			INFOFLOG("Formatted {} of {}: {} {} {} {{braces}} {} {}", 1, std::string("two"), 3.5, L'\u0107', true, -42, L"wide");
+			WARNFLOG("Formatted warning {}{}", 'x', '\xe9'); // char is codepoint as in LVLBLOG
+			TRACEFLOG("Formatted trace {}", 1); // below level of the sink
+			logger_scope->drain();
+			logger_scope->removeSink("ring");
+			std::vector<std::string> const lines(ring->lines());
+			assert(2 == lines.size());
+			assert(std::string::npos != lines[0].find(" Formatted 1 of two: 3.5 \xc4\x87 true {braces} -42 wide\n"));
+			assert(std::string::npos != lines[1].find(" WARN: Formatted warning x\xc3\xa9\n"));
+		}
+		{
+			bmu::LogRingSinkPtr ring(std::make_shared<bmu::LogRingSink>(4));
+			logger_scope->setSink("ring", ring, bmu::LINFO);
+			INFOCLOG(L"Wide \u0107 converted by writer"); // no codecvt locale on std::wclog
+			logger_scope->drain();
+			logger_scope->removeSink("ring");
+			std::vector<std::string> const lines(ring->lines());
+			assert(1 == lines.size() && std::string::npos != lines[0].find("Wide \xc4\x87 converted by writer\n"));
+		}
+		{
+			bool const installed = bmu::installFlightRecorder(L"test_bmulog.crash", bmu::LTRACE, 4096);
+			assert(installed);
+			assert(bmu::logmanip::isEnabled(bmu::LTRACE) && !bmu::logmanip::isOutput(bmu::LTRACE));
+			for (int i = 0; i < 100; ++i)
+				TRACECLOG8("Trace line " << i << " kept only by flight recorder");
+			INFOCLOG("Info line in the output and in flight recorder");
+			bool const written = bmu::dumpFlightRecorder(L"test_bmulog.flight");
+			assert(written);
+			bmu::uninstallFlightRecorder();
+			assert(!bmu::logmanip::isEnabled(bmu::LTRACE));
+			std::ifstream in("test_bmulog.flight", std::ios::binary);
+			std::string const dumped((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			assert(0 == dumped.find("**** flight recorder, signal 0 ****\n---- thread "));
+			assert(std::string::npos == dumped.find("Trace line 0 ")); // ring has only recent lines
+			assert(std::string::npos != dumped.find("Trace line 99 kept only by flight recorder\n"));
+			assert(std::string::npos != dumped.find("Info line in the output and in flight recorder\n"));
+		}
+		INFOBLOG("Deferred info {} of {}", 1, std::string("two"));
+		WARNBLOG("Deferred {{braces}} {} {} {}", 3.5, 'c', wcMsg);
+		logger_scope->setBinlogOutput(L"test_bmulog.blog");
+		for (int i = 0; i < 10; ++i)
+			INFOBLOG("Binary record {} of {}", i, 10u);
+		INFOSLOG("request done", bmu::field("user", 42), bmu::field("latency", 3.5), bmu::field("path", std::string("/a b")), bmu::field("ok", true));
+		std::string const longformat(70000, 'f'); // longer than u16 length
+		INFOBLOG(longformat.c_str());
+	}
+	{
+		std::ifstream in("test_bmulog.blog", std::ios::binary);
+		std::ostringstream decoded;
+		long long const count = bmu::decodeBinlog(in, decoded);
+		assert(12 == count);
+		assert(!in.bad());
+		assert(std::wstring::npos != decoded.str().find("Binary record 9 of 10\n"));
+		assert(std::wstring::npos != decoded.str().find(std::string(70000, 'f') + "\n"));
+		assert(std::wstring::npos != decoded.str().find(" level=info msg=\"request done\" thread="));
+		assert(std::wstring::npos != decoded.str().find(" user=42 latency=3.5 path=\"/a b\" ok=true\n"));
+		in.clear();
+		in.seekg(0);
+		std::ostringstream json;
+		long long const jsoncount = bmu::decodeBinlog(in, json, bmu::STRUCTFORMAT_JSON);
+		assert(12 == jsoncount);
+		assert(std::wstring::npos != json.str().find(",\"level\":\"info\",\"msg\":\"request done\",\"thread\":"));
+		assert(std::wstring::npos != json.str().find(",\"user\":42,\"latency\":3.5,\"path\":\"/a b\",\"ok\":true}\n"));
+	}
+	{
+		std::uint32_t const huge = 0xfffffff0u; // as id and lengths, nothing of that size is allocated
+		std::string corrupted("BMUBLOG2F");
+		corrupted.append((char const*)&huge, sizeof(huge));
+		corrupted.append(5, '\0'); // level and line
+		corrupted.append((char const*)&huge, sizeof(huge));
+		corrupted.append("file");
+		std::istringstream in(corrupted);
+		std::ostringstream decoded;
+		long long count = bmu::decodeBinlog(in, decoded);
+		assert(0 == count);
+		assert(in.bad());
+		std::string const record = std::string("R") + std::string(12, '\0') + std::string((char const*)&huge, sizeof(huge)) + "args";
+		std::istringstream inrecord(std::string("BMUBLOG2") + record);
+		count = bmu::decodeBinlog(inrecord, decoded);
+		assert(0 == count);
+		assert(inrecord.bad());
+		std::string badlevel("BMUBLOG2F");
+		badlevel.append(4, '\0'); // id
+		badlevel.push_back('\xc8'); // level 200
+		badlevel.append(12, '\0'); // line and lengths of file and format
+		std::istringstream inlevel(badlevel + "R" + std::string(16, '\0')); // record would be decoded with valid level
+		count = bmu::decodeBinlog(inlevel, decoded);
+		assert(0 == count);
+		assert(inlevel.bad());
+		assert(decoded.str().empty());
 	}
 
 	printf("%s", "Bye\n");
@@ -0,0 +1,66 @@
+#include "bmu/Logger.h"
+#include "bmu/BinLog.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts heap allocations made by the logging thread while counting is on. Same loop as
+// bench_bmulog but with wide literals because narrow strings are widened through temporary
+// buffer by std::wostream itself. The same lines are logged through UTF-8 std::clog and as
+// structured records with scalar fields.
+static std::atomic<size_t> allocations(0);
+static thread_local bool counting = false;
+
+void* operator new(std::size_t n)
+{
+	if (counting)
+		++allocations;
+	if (void* p = std::malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+/// One call site, it registers its descriptor on the first call during warm up
+static void log_structured(int i)
+{
+	INFOSLOG("bmulog structured repetition", bmu::field("i", i), bmu::field("ratio", i / 3.0), bmu::field("even", 0 == i % 2));
+}
+
+int main(void)
+{
+	bmu::LogsFactoryPtr logger_scope(bmu::LogsFactory::create());
+	logger_scope->setClogOutput(L"test_logalloc");
+	logger_scope->setModifiers({ bmu::logmod_time, bmu::logmod_threadid });
+	bmu::logmanip::setThreadName(L"alloc test ");
+
+	// warm up: every queue cell and the staging buffer get capacity for longer lines than measured
+	for (int i = 0; i < 20000; ++i) {
+		std::wclog << L"bmulog message repetition " << i << L": This is some random log message repeated many times, warming up" << std::endl;
+		std::clog << "bmulog UTF-8 message repetition " << i << ": This is some random log message repeated many times, warming up" << std::endl;
+		log_structured(i);
+	}
+
+	int msgcount = 100000;
+	counting = true;
+	for (int i = 0; i < msgcount; ++i)
+		std::wclog << L"bmulog message repetition " << i << L": This is some random log message repeated many times" << std::endl;
+	for (int i = 0; i < msgcount; ++i)
+		std::clog << "bmulog UTF-8 message repetition " << i << ": This is some random log message repeated many times" << std::endl;
+	for (int i = 0; i < msgcount; ++i)
+		log_structured(i);
+	counting = false;
+
+	std::cout << "Allocations for " << msgcount << " wide, " << msgcount << " UTF-8 and " << msgcount << " structured log lines: " << allocations << std::endl;
+	assert(0 == allocations);
+	return 0 == allocations ? 0 : 1;
+}
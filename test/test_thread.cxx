@@ -1,7 +1,10 @@
+#include "bmu/mpsc_queue.hxx"
 #include "bmu/single_shared.hxx"
 #include "bmu/thread_types.hxx"
+#include <cassert>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #if 0
 thread_local unsigned int rage = 1;
@@ -42,6 +45,58 @@ private:
 	int arg;
 };
 
+/// Producers push their own increasing numbers into small queue, so it's full most of the time. Consumer
+/// sleeps on notifier and a lost wakeup would leave it sleeping until timeout with items in the queue,
+/// producers sleep on another one until consumer makes room.
+void stress_queue(void)
+{
+	size_t const producers = 4;
+	size_t const items = 100000;
+	struct item {
+		size_t producer;
+		size_t seq;
+	};
+	bmu::bounded_mpsc_queue<item> queue(64);
+	bmu::event_notifier ready;
+	bmu::event_notifier room;
+	std::atomic<size_t> running(producers);
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < producers; ++p) {
+		threads.emplace_back([&, p] {
+			for (size_t i = 0; i < items; ++i) {
+				while (!queue.try_push([&](item& it) { it.producer = p; it.seq = i; })) {
+					ready.notify_one();
+					room.wait([&] { return !queue.full(); });
+				}
+				ready.notify_one();
+			}
+			--running;
+			ready.notify_one();
+		});
+	}
+	std::vector<size_t> next(producers, 0);
+	size_t received = 0;
+	for (;;) {
+		auto const wanted = [&] { return !queue.empty() || !running; };
+		ready.wait_for(wanted, std::chrono::milliseconds(10000));
+		assert(wanted()); // woken without timeout
+		while (queue.try_pop([&](item& it) {
+			assert(it.producer < producers);
+			assert(next[it.producer] == it.seq); // exactly once, in order of the producer
+			++next[it.producer];
+			++received;
+		}))
+			room.notify_all();
+		if (!running && queue.empty())
+			break;
+	}
+	for (std::thread& t : threads)
+		t.join();
+	assert(producers * items == received);
+	for (size_t n : next)
+		assert(items == n);
+}
+
 typedef bmu::single_shared<Test> TestSingle;
 typedef std::shared_ptr<TestSingle> TestSinglePtr;
 
@@ -80,6 +135,7 @@ int main(int argc, char* argv[])
 		}
 		assert(3 == ref_2->getArg());
 	}
+	stress_queue();
 	std::clog << "Bye" << std::endl;
 	std::cin.get();
 	return 0;
@@ -1,6 +1,13 @@
 #pragma once
 #include <thread>
+#include <chrono>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cassert>
 
 namespace beam_me_up {}
 namespace bmu = beam_me_up;
@@ -61,4 +68,64 @@ public:
 private:
 	std::shared_ptr<tss_ptr<std::wstring>> str;
 };
+
+//Wakeup of sleeping threads. Notifier takes mutex only when some thread announced it's going to
+//sleep so notify on the fast path is just a fence and an atomic load (like futex or eventfd).
+class event_notifier {
+	event_notifier(event_notifier const&) = delete;
+	void operator = (event_notifier const&) = delete;
+public:
+	event_notifier(void)
+		: sleeping(0)
+	{ }
+	/// Call after the state checked by wait predicate is published.
+	void notify_one(void)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_one();
+		}
+	}
+	/// Same as notify_one for state which lets more waiting threads continue
+	void notify_all(void)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_all();
+		}
+	}
+	/// Blocks until ready() gives true.
+	template<typename _Pred>
+	void wait(_Pred ready)
+	{
+		if (ready())
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		sleeping.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!ready())
+			cond.wait(lock);
+		sleeping.fetch_sub(1, std::memory_order_relaxed);
+	}
+	/// Same as wait but returns after timeout too, zero timeout waits without limit.
+	template<typename _Pred>
+	void wait_for(_Pred ready, std::chrono::milliseconds timeout)
+	{
+		if (!timeout.count())
+			return wait(ready);
+		if (ready())
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		sleeping.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cond.wait_for(lock, timeout, ready);
+		sleeping.fetch_sub(1, std::memory_order_relaxed);
+	}
+private:
+	std::atomic<int>        sleeping; // threads in wait
+	std::mutex              mutex;
+	std::condition_variable cond;
+};
 }
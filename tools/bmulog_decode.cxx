@@ -0,0 +1,38 @@
+#include "bmu/BinLog.h"
+#include <fstream>
+#include <iostream>
+
+// Writes binary log (see LogsFactoryBase::setBinlogOutput) as text to standard output.
+// Structured records are written as logfmt, or JSON with --json.
+int main(int argc, char* argv[])
+{
+	int first = 1;
+	bmu::structformat_e style = bmu::STRUCTFORMAT_LOGFMT;
+	if (argc > 1 && std::string("--json") == argv[1]) {
+		style = bmu::STRUCTFORMAT_JSON;
+		++first;
+	}
+	if (argc <= first) {
+		std::cerr << "Usage: " << argv[0] << " [--json] binary-log-file..." << std::endl;
+		return 2;
+	}
+	int result = 0;
+	for (int i = first; i < argc; ++i) {
+		std::ifstream in(argv[i], std::ios::in | std::ios::binary);
+		if (!in.is_open()) {
+			std::cerr << "Can't open " << argv[i] << std::endl;
+			result = 1;
+			continue;
+		}
+		long long const count = bmu::decodeBinlog(in, std::cout, style);
+		if (count < 0) {
+			std::cerr << argv[i] << " is not a binary log" << std::endl;
+			result = 1;
+		}
+		else if (in.bad()) {
+			std::cerr << argv[i] << " is truncated or corrupted after " << count << " records" << std::endl;
+			result = 1;
+		}
+	}
+	return result;
+}
@@ -0,0 +1,64 @@
+#include "bmu/LogIndex.h"
+#include "bmu/codepoint_transform.hxx"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+#endif
+
+// Writes lines of clog files (see FileBatching::indexrecords) logged between two local times to
+// standard output, using their sidecar indexes. Files are a rotated set in any order, e.g. log-*.
+static bool parseTime(char const* s, std::chrono::system_clock::time_point& t)
+{
+	std::tm tm = {};
+	char rest = 0;
+	if (6 != std::sscanf(s, "%2d%2d%2d-%2d%2d%2d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &rest))
+		return false;
+	tm.tm_year += 100; // yy of file names
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	std::time_t const time = std::mktime(&tm);
+	if ((std::time_t)-1 == time)
+		return false;
+	t = std::chrono::system_clock::from_time_t(time);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	int first = 1;
+	long latencyms = 1000;
+	if (argc > 2 && 0 == std::strcmp("--latency", argv[1])) {
+		latencyms = std::strtol(argv[2], nullptr, 10);
+		first += 2;
+	}
+	std::chrono::system_clock::time_point from, to;
+	if (argc <= first + 2 || !parseTime(argv[first], from) || !parseTime(argv[first + 1], to)) {
+		std::cerr << "Usage: " << argv[0] << " [--latency ms] from-yymmdd-HHMMSS to-yymmdd-HHMMSS clog-file..." << std::endl;
+		return 2;
+	}
+	to += std::chrono::seconds(1); // until the end of the second
+	std::vector<std::wstring> filenames;
+	for (int i = first + 2; i < argc; ++i) {
+		filenames.emplace_back();
+		bmu::appendUTF8AsWide(filenames.back(), argv[i], std::strlen(argv[i]));
+	}
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY); // lines are copied as they are
+#endif
+	int result = 0;
+	bmu::MappedFile log;
+	for (bmu::LogRange const& range : bmu::findLogRanges(filenames, from, to, std::chrono::milliseconds(latencyms))) {
+		if (!log.open(range.filename) || log.size() < range.end) {
+			std::wcerr << L"Can't read " << range.filename << std::endl;
+			result = 1;
+			continue;
+		}
+		std::fwrite(log.data() + range.begin, 1, (size_t)(range.end - range.begin), stdout);
+	}
+	return result;
+}